@@ -1,65 +1,563 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <assert.h>
-#include <SDL2/SDL.h>
+#include <stdatomic.h>
 #include <time.h>
-#include "sim.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "sim_core.h"
 
-#define FRAME_TICKS 50
+_Thread_local SimContext *SimCurrent = NULL;
 
-static SDL_Renderer *Renderer = NULL;
-static SDL_Window *Window = NULL;
-static Uint32 Ticks = 0;
+static atomic_int ContextCount;
+
+// SIM_BACKEND=sdl|headless, SDL is the default when it is compiled in
+static const SimBackend *selectBackend()
+{
+    const char *name = getenv("SIM_BACKEND");
+#ifdef SIM_HAVE_SDL
+    if (!name || !strcmp(name, SimSdlBackend.Name))
+        return &SimSdlBackend;
+#endif
+    if (!name || !strcmp(name, SimHeadlessBackend.Name))
+        return &SimHeadlessBackend;
+    fprintf(stderr, "[SIM] Unknown backend '%s', using %s\n", name, SimHeadlessBackend.Name);
+    return &SimHeadlessBackend;
+}
+
+// xoshiro128** generator. Every context owns its state, seeded from the
+// global seed and a stream number: the context id, so each context
+// reproduces the same sequence for the same seed whichever thread runs it.
+// Threads without a current context share nothing either, their stream is
+// the order in which they first ask for numbers
+
+// A state of generation 0 is not seeded yet. The global generation starts
+// at 1, so simRand before any simSeed still seeds from the default seed 0
+// instead of running from the all-zero state, which only yields zeros.
+// simSeed publishes Seed with the generation bump
+static atomic_ullong Seed;
+static atomic_uint SeedGeneration = 1;
+static atomic_uint ThreadCount;
+
+static _Thread_local SimRandState ThreadRand;
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static inline uint32_t rotl(uint32_t x, int k)
+{
+    return (x << k) | (x >> (32 - k));
+}
+
+static inline uint32_t xoshiro128ss(uint32_t *s)
+{
+    uint32_t result = rotl(s[1] * 5, 7) * 9;
+    uint32_t t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 11);
+    return result;
+}
+
+static void seedStream(SimRandState *r, unsigned stream, unsigned generation)
+{
+    r->Stream = stream;
+    uint64_t x = atomic_load_explicit(&Seed, memory_order_relaxed) ^ ((uint64_t)stream << 32);
+    uint64_t a = splitmix64(&x);
+    uint64_t b = splitmix64(&x);
+    r->State[0] = (uint32_t)a;
+    r->State[1] = (uint32_t)(a >> 32);
+    r->State[2] = (uint32_t)b;
+    r->State[3] = (uint32_t)(b >> 32) | 1;
+    r->Generation = generation;
+}
+
+static inline uint32_t *randState()
+{
+    unsigned generation = atomic_load_explicit(&SeedGeneration, memory_order_acquire);
+    SimContext *ctx = SimCurrent;
+    SimRandState *r = ctx ? &ctx->Rand : &ThreadRand;
+    if (r->Generation != generation)
+    {
+        unsigned stream = r->Stream;
+        if (ctx)
+            stream = ctx->Id;
+        else if (!r->Generation)
+            stream = atomic_fetch_add(&ThreadCount, 1);
+        seedStream(r, stream, generation);
+    }
+    return r->State;
+}
+
+void simSeed(unsigned long long seed)
+{
+    atomic_store_explicit(&Seed, seed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&SeedGeneration, 1, memory_order_release);
+}
+
+// Picks SIM_SEED, or the current time, unless a seed was already set.
+// Call before starting threads that run contexts
+void simSeedFromEnv()
+{
+    if (atomic_load(&SeedGeneration) > 1)
+        return;
+    const char *seed = getenv("SIM_SEED");
+    if (seed)
+    {
+        simSeed(strtoull(seed, NULL, 0));
+    }
+    else
+    {
+        unsigned long long now = time(NULL);
+        fprintf(stderr, "[SIM] SIM_SEED=%llu\n", now);
+        simSeed(now);
+    }
+}
+
+// Same range as rand(): non-negative, so callers can take % safely
+int simRand()
+{
+    int value = xoshiro128ss(randState()) >> 1;
+    if (SimCurrent && SimCurrent->Record)
+        simRecordRand(SimCurrent->Record, value);
+    return value;
+}
+
+void simRandN(int *out, int n)
+{
+    uint32_t *state = randState();
+    uint32_t s[4] = {state[0], state[1], state[2], state[3]};
+    for (int i = 0; i < n; i++)
+        out[i] = xoshiro128ss(s) >> 1;
+    state[0] = s[0];
+    state[1] = s[1];
+    state[2] = s[2];
+    state[3] = s[3];
+    if (SimCurrent && SimCurrent->Record)
+    {
+        for (int i = 0; i < n; i++)
+            simRecordRand(SimCurrent->Record, out[i]);
+    }
+}
+
+void *simCalloc(size_t count, size_t size, const char *what)
+{
+    void *p = calloc(count, size);
+    if (!p)
+    {
+        fprintf(stderr, "[SIM] Out of memory for %s\n", what);
+        abort();
+    }
+    return p;
+}
+
+SimContext *simContextCreate()
+{
+    SimContext *ctx = simCalloc(1, sizeof(SimContext), "a sim context");
+    ctx->Buffers = simCalloc(2, sizeof(*ctx->Buffers), "a sim context");
+    ctx->Id = atomic_fetch_add(&ContextCount, 1);
+    ctx->Framebuffer = ctx->Buffers[0];
+    return ctx;
+}
+
+void simContextDestroy(SimContext *ctx)
+{
+    if (SimCurrent == ctx)
+        SimCurrent = NULL;
+    simStatsDestroy(ctx);
+    free(ctx->Buffers);
+    free(ctx);
+}
+
+void simContextMakeCurrent(SimContext *ctx)
+{
+    SimCurrent = ctx;
+}
+
+SimContext *simContextCurrent()
+{
+    return SimCurrent;
+}
+
+unsigned long simContextRun(SimContext *ctx, void (*entry)(void))
+{
+    SimContext *prev = SimCurrent;
+    jmp_buf done;
+    SimCurrent = ctx;
+    ctx->Done = &done;
+    if (!setjmp(done))
+    {
+        simInit();
+        entry();
+        simExit();
+    }
+    ctx->Done = NULL;
+    SimCurrent = prev;
+    return ctx->Frame;
+}
+
+const char *simContextPath(const SimContext *ctx, const char *path, char *buf, int size)
+{
+    if (!ctx->Id)
+        return path;
+    const char *ext = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    if (!ext || (slash && ext < slash))
+        ext = path + strlen(path);
+    snprintf(buf, size, "%.*s-%d%s", (int)(ext - path), path, ctx->Id, ext);
+    return buf;
+}
+
+int simFrameListed(const char *list, unsigned long frame)
+{
+    const char *p = list;
+    while (p && *p)
+    {
+        char *end;
+        unsigned long lo = strtoul(p, &end, 10);
+        unsigned long hi = lo;
+        if (*end == '-')
+            hi = strtoul(end + 1, &end, 10);
+        if (end == p)
+            return 0;
+        if (lo <= frame && frame <= hi)
+            return 1;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return 0;
+}
 
 void simInit()
 {
-    SDL_Init(SDL_INIT_VIDEO);
-    SDL_CreateWindowAndRenderer(SIM_X_SIZE, SIM_Y_SIZE, 0, &Window, &Renderer);
-    SDL_SetRenderDrawColor(Renderer, 0, 0, 0, 0);
-    SDL_RenderClear(Renderer);
-    srand(time(NULL));
+    if (!SimCurrent)
+        SimCurrent = simContextCreate();
+    SimContext *ctx = SimCurrent;
+    ctx->Backend = selectBackend();
+    simSeedFromEnv();
+    seedStream(&ctx->Rand, ctx->Id, atomic_load(&SeedGeneration));
+    simSchedInit(ctx);
+    simCaptureOpen(ctx);
+    ctx->Backend->Init(ctx);
+    // Window and backend setup is not app time of frame 0
+    simStatsInit(ctx);
+    // Backend surfaces start undefined, the first present uploads everything
+    simMarkDirty(ctx, 0, 0, SIM_X_SIZE - 1, SIM_Y_SIZE - 1);
     simPutPixel(0, 0, 0);
     simFlush();
+    simRecordOpen(ctx);
 }
 
 void simExit()
 {
-    SDL_Event event;
-    while (1)
+    SimContext *ctx = SimCurrent;
+    simRecordClose(ctx);
+    simCaptureClose(ctx);
+    simStatsReport(ctx);
+    ctx->Backend->Exit(ctx);
+}
+
+// Turns the dirty tile mask into rectangles: horizontal runs of tiles in
+// a row, extended downwards while the next row has the same run
+static int collectDirtyRects(SimContext *ctx, SimRect *rects)
+{
+    int count = 0;
+    for (int ty = 0; ty < SIM_TILES_Y; ty++)
     {
-        if (SDL_PollEvent(&event) && event.type == SDL_QUIT)
-            break;
+        uint32_t row = ctx->DirtyTiles[ty];
+        while (row)
+        {
+            int tx0 = __builtin_ctz(row);
+            int tx1 = tx0;
+            while (tx1 + 1 < SIM_TILES_X && (row >> (tx1 + 1)) & 1)
+                tx1++;
+            uint32_t run = (uint32_t)((2ull << tx1) - (1ull << tx0));
+            int ty1 = ty;
+            while (ty1 + 1 < SIM_TILES_Y && (ctx->DirtyTiles[ty1 + 1] & run) == run)
+            {
+                ty1++;
+                ctx->DirtyTiles[ty1] &= ~run;
+            }
+            row &= ~run;
+
+            SimRect *r = &rects[count++];
+            r->x = tx0 * SIM_TILE_SIZE;
+            r->y = ty * SIM_TILE_SIZE;
+            r->w = (tx1 + 1) * SIM_TILE_SIZE;
+            r->h = (ty1 + 1) * SIM_TILE_SIZE;
+            if (r->w > SIM_X_SIZE)
+                r->w = SIM_X_SIZE;
+            if (r->h > SIM_Y_SIZE)
+                r->h = SIM_Y_SIZE;
+            r->w -= r->x;
+            r->h -= r->y;
+        }
+        ctx->DirtyTiles[ty] = 0;
     }
-    SDL_DestroyRenderer(Renderer);
-    SDL_DestroyWindow(Window);
-    SDL_Quit();
+    return count;
 }
 
 void simFlush()
 {
-    SDL_PumpEvents();
-    assert(SDL_TRUE != SDL_HasEvent(SDL_QUIT) && "User-requested quit");
-    Uint32 cur_ticks = SDL_GetTicks() - Ticks;
-    if (cur_ticks < FRAME_TICKS)
+    SimContext *ctx = SimCurrent;
+    if (ctx->Record)
+        simRecordFlush(ctx->Record);
+    simStatsFlushBegin(ctx);
+    if (ctx->Capture)
+        simCaptureFrame(ctx);
+    SimRect dirty[SIM_MAX_DIRTY_RECTS];
+    int count = collectDirtyRects(ctx, dirty);
+    uint64_t upload = 0;
+    for (int i = 0; i < count; i++)
+        upload += (uint64_t)dirty[i].w * dirty[i].h * sizeof(uint32_t);
+    int running = ctx->Backend->Present(ctx, dirty, count);
+    if (ctx->FrameLimit && ctx->Frame >= ctx->FrameLimit)
+        running = 0;
+    simStatsFlushEnd(ctx, upload);
+    ctx->Frame++;
+    if (!running)
     {
-        SDL_Delay(FRAME_TICKS - cur_ticks);
+        simExit();
+        if (ctx->Done)
+            longjmp(*ctx->Done, 1);
+        exit(EXIT_SUCCESS);
     }
-    SDL_RenderPresent(Renderer);
 }
 
 void simPutPixel(int x, int y, int argb)
 {
     assert(0 <= x && x < SIM_X_SIZE && "Out of range");
     assert(0 <= y && y < SIM_Y_SIZE && "Out of range");
-    Uint8 a = argb >> 24;
-    Uint8 r = (argb >> 16) & 0xFF;
-    Uint8 g = (argb >> 8) & 0xFF;
-    Uint8 b = argb & 0xFF;
-    SDL_SetRenderDrawColor(Renderer, r, g, b, a);
-    SDL_RenderDrawPoint(Renderer, x, y);
-    Ticks = SDL_GetTicks();
+    SimContext *ctx = SimCurrent;
+    ctx->Framebuffer[y][x] = argb;
+    simMarkDirtyPixel(ctx, x, y);
+    if (ctx->Record)
+        simRecordPixel(ctx->Record, x, y, argb);
+    ctx->Count.Pixels++;
+    ctx->Count.Calls++;
 }
 
-int simRand()
+// Range check of a whole batch, four coordinates per compare with SSE2
+static int batchInRange(const int *xs, const int *ys, int n)
 {
-    return rand();
-}
\ No newline at end of file
+    int i = 0;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i maxX = _mm_set1_epi32(SIM_X_SIZE - 1);
+    __m128i maxY = _mm_set1_epi32(SIM_Y_SIZE - 1);
+    __m128i bad = zero;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(xs + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(ys + i));
+        bad = _mm_or_si128(bad, _mm_cmplt_epi32(x, zero));
+        bad = _mm_or_si128(bad, _mm_cmpgt_epi32(x, maxX));
+        bad = _mm_or_si128(bad, _mm_cmplt_epi32(y, zero));
+        bad = _mm_or_si128(bad, _mm_cmpgt_epi32(y, maxY));
+    }
+    if (_mm_movemask_epi8(bad))
+        return 0;
+#endif
+    for (; i < n; i++)
+    {
+        if ((unsigned)xs[i] >= SIM_X_SIZE || (unsigned)ys[i] >= SIM_Y_SIZE)
+            return 0;
+    }
+    return 1;
+}
+
+void simPutPixels(const int *xs, const int *ys, const int *argb, int n)
+{
+    assert(batchInRange(xs, ys, n) && "Out of range");
+    SimContext *ctx = SimCurrent;
+    if (ctx->Record)
+        simRecordPixels(ctx->Record, xs, ys, argb, n);
+    ctx->Count.Pixels += n;
+    ctx->Count.Calls++;
+    for (int i = 0; i < n; i++)
+    {
+        ctx->Framebuffer[ys[i]][xs[i]] = argb[i];
+        simMarkDirtyPixel(ctx, xs[i], ys[i]);
+    }
+}
+
+void simPutPixelsColor(const int *xs, const int *ys, int argb, int n)
+{
+    assert(batchInRange(xs, ys, n) && "Out of range");
+    SimContext *ctx = SimCurrent;
+    if (ctx->Record)
+        simRecordPixelsColor(ctx->Record, xs, ys, argb, n);
+    ctx->Count.Pixels += n;
+    ctx->Count.Calls++;
+    for (int i = 0; i < n; i++)
+    {
+        ctx->Framebuffer[ys[i]][xs[i]] = argb;
+        simMarkDirtyPixel(ctx, xs[i], ys[i]);
+    }
+}
+
+static void fillSpan(uint32_t *dst, int len, uint32_t argb)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128i color = _mm_set1_epi32(argb);
+    for (; i + 16 <= len; i += 16)
+    {
+        _mm_storeu_si128((__m128i *)(dst + i), color);
+        _mm_storeu_si128((__m128i *)(dst + i + 4), color);
+        _mm_storeu_si128((__m128i *)(dst + i + 8), color);
+        _mm_storeu_si128((__m128i *)(dst + i + 12), color);
+    }
+    for (; i + 4 <= len; i += 4)
+        _mm_storeu_si128((__m128i *)(dst + i), color);
+#endif
+    for (; i < len; i++)
+        dst[i] = argb;
+}
+
+void simDrawSpan(int x, int y, int len, int argb)
+{
+    simFillRect(x, y, len, 1, argb);
+}
+
+void simFillRect(int x, int y, int width, int height, int argb)
+{
+    int x0 = x < 0 ? 0 : x;
+    int y0 = y < 0 ? 0 : y;
+    int x1 = x + width > SIM_X_SIZE ? SIM_X_SIZE : x + width;
+    int y1 = y + height > SIM_Y_SIZE ? SIM_Y_SIZE : y + height;
+    SimContext *ctx = SimCurrent;
+    if (ctx->Record)
+        simRecordFill(ctx->Record, x, y, width, height, argb);
+    ctx->Count.Calls++;
+    if (x0 >= x1 || y0 >= y1)
+        return;
+    ctx->Count.Pixels += (uint64_t)(x1 - x0) * (y1 - y0);
+    for (int j = y0; j < y1; j++)
+        fillSpan(&ctx->Framebuffer[j][x0], x1 - x0, argb);
+    simMarkDirty(ctx, x0, y0, x1 - 1, y1 - 1);
+}
+
+void simDrawRectangle(int x, int y, int width, int height, int argb)
+{
+    simFillRect(x, y, width, height, argb);
+}
+
+static inline void putClipped(uint32_t (*fb)[SIM_X_SIZE], int x, int y, uint32_t argb)
+{
+    if ((unsigned)x < SIM_X_SIZE && (unsigned)y < SIM_Y_SIZE)
+        fb[y][x] = argb;
+}
+
+// Midpoint circle, same outline as draw_circle in app.c
+void simDrawCircle(int x0, int y0, int radius, int argb)
+{
+    int x = radius;
+    int y = 0;
+    int decisionOver2 = 1 - x;
+    // Fully visible circles skip the per-point clipping
+    int inside = x0 - radius >= 0 && x0 + radius < SIM_X_SIZE &&
+                 y0 - radius >= 0 && y0 + radius < SIM_Y_SIZE;
+    SimContext *ctx = SimCurrent;
+    uint32_t (*fb)[SIM_X_SIZE] = ctx->Framebuffer;
+    if (ctx->Record)
+        simRecordCircle(ctx->Record, x0, y0, radius, argb);
+    ctx->Count.Calls++;
+    if (radius < 0)
+        return;
+    if (inside)
+    {
+        simMarkDirty(ctx, x0 - radius, y0 - radius, x0 + radius, y0 + radius);
+    }
+    else
+    {
+        int bx0 = x0 - radius < 0 ? 0 : x0 - radius;
+        int by0 = y0 - radius < 0 ? 0 : y0 - radius;
+        int bx1 = x0 + radius >= SIM_X_SIZE ? SIM_X_SIZE - 1 : x0 + radius;
+        int by1 = y0 + radius >= SIM_Y_SIZE ? SIM_Y_SIZE - 1 : y0 + radius;
+        if (bx0 > bx1 || by0 > by1)
+            return;
+        simMarkDirty(ctx, bx0, by0, bx1, by1);
+    }
+    while (y <= x)
+    {
+        if (inside)
+        {
+            fb[y0 + y][x0 + x] = argb;
+            fb[y0 + x][x0 + y] = argb;
+            fb[y0 + y][x0 - x] = argb;
+            fb[y0 + x][x0 - y] = argb;
+            fb[y0 - y][x0 - x] = argb;
+            fb[y0 - x][x0 - y] = argb;
+            fb[y0 - y][x0 + x] = argb;
+            fb[y0 - x][x0 + y] = argb;
+        }
+        else
+        {
+            putClipped(fb, x0 + x, y0 + y, argb);
+            putClipped(fb, x0 + y, y0 + x, argb);
+            putClipped(fb, x0 - x, y0 + y, argb);
+            putClipped(fb, x0 - y, y0 + x, argb);
+            putClipped(fb, x0 - x, y0 - y, argb);
+            putClipped(fb, x0 - y, y0 - x, argb);
+            putClipped(fb, x0 + x, y0 - y, argb);
+            putClipped(fb, x0 + y, y0 - x, argb);
+        }
+        ctx->Count.Pixels += 8;
+        y++;
+        if (decisionOver2 <= 0)
+        {
+            decisionOver2 += 2 * y + 1;
+        }
+        else
+        {
+            x--;
+            decisionOver2 += 2 * (y - x) + 1;
+        }
+    }
+}
+
+void simSwapBuffers(SimContext *ctx, const SimRect *dirty, int count)
+{
+    uint32_t (*front)[SIM_X_SIZE] = ctx->Framebuffer;
+    ctx->Framebuffer = (front == ctx->Buffers[0]) ? ctx->Buffers[1] : ctx->Buffers[0];
+    for (int i = 0; i < count; i++)
+    {
+        const SimRect *r = &dirty[i];
+        for (int y = r->y; y < r->y + r->h; y++)
+            memcpy(&ctx->Framebuffer[y][r->x], &front[y][r->x], r->w * sizeof(uint32_t));
+    }
+}
+
+int simWritePPM(SimContext *ctx, const char *path)
+{
+    FILE *out = fopen(path, "wb");
+    if (!out)
+    {
+        fprintf(stderr, "[SIM] Can't open %s for writing\n", path);
+        return -1;
+    }
+    uint8_t row[SIM_X_SIZE * 3];
+    fprintf(out, "P6\n%d %d\n255\n", SIM_X_SIZE, SIM_Y_SIZE);
+    for (int y = 0; y < SIM_Y_SIZE; y++)
+    {
+        for (int x = 0; x < SIM_X_SIZE; x++)
+        {
+            uint32_t argb = ctx->Framebuffer[y][x];
+            row[3 * x + 0] = (argb >> 16) & 0xFF;
+            row[3 * x + 1] = (argb >> 8) & 0xFF;
+            row[3 * x + 2] = argb & 0xFF;
+        }
+        fwrite(row, sizeof(row), 1, out);
+    }
+    return fclose(out);
+}
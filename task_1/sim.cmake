@@ -0,0 +1,32 @@
+# Sim runtime as the static library sim, for this project and the ones that
+# link the runtime into their own apps (task_2, task_4):
+#   include(${CMAKE_CURRENT_SOURCE_DIR}/../task_1/sim.cmake)
+#   target_link_libraries(<target> sim)
+# Tools decoding sim or trace streams link sim_file (simReadFile) alone
+# The SDL backend is built in when SDL2 is found and SIM_HEADLESS is off,
+# SIM_HAVE_SDL is then set here and defined for every target linking sim
+
+option(SIM_HEADLESS "Build the sim runtime without the SDL backend" OFF)
+
+set(SIM_DIR ${CMAKE_CURRENT_LIST_DIR})
+add_library(sim_file STATIC ${SIM_DIR}/sim_file.c)
+target_include_directories(sim_file PUBLIC ${SIM_DIR})
+
+add_library(sim STATIC
+    ${SIM_DIR}/sim.c ${SIM_DIR}/sim_sched.c ${SIM_DIR}/sim_stats.c ${SIM_DIR}/sim_perf.c
+    ${SIM_DIR}/sim_record.c ${SIM_DIR}/sim_capture.c ${SIM_DIR}/sim_headless.c)
+set_target_properties(sim PROPERTIES POSITION_INDEPENDENT_CODE ON)
+target_include_directories(sim PUBLIC ${SIM_DIR})
+
+if(NOT SIM_HEADLESS)
+  find_package(SDL2 QUIET)
+endif()
+set(SIM_HAVE_SDL ${SDL2_FOUND})
+if(SIM_HAVE_SDL)
+  target_sources(sim PRIVATE ${SIM_DIR}/sim_sdl.c)
+  target_include_directories(sim PUBLIC ${SDL2_INCLUDE_DIRS})
+  target_compile_definitions(sim PUBLIC SIM_HAVE_SDL)
+  target_link_libraries(sim PUBLIC ${SDL2_LIBRARIES})
+else()
+  message(STATUS "SDL2 backend disabled, building headless sim runtime only")
+endif()
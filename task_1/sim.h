@@ -10,12 +10,39 @@ extern "C" {
 void simFlush();
 void simPutPixel(int x, int y, int argb);
 int simRand();
+// Seeds simRand for every context and thread, overrides SIM_SEED when called before simInit
+void simSeed(unsigned long long seed);
+// Fills out with n simRand values
+void simRandN(int *out, int n);
+
+// Primitives are clipped to the screen, off-screen parts are dropped
+void simDrawSpan(int x, int y, int len, int argb);
+void simFillRect(int x, int y, int width, int height, int argb);
+void simDrawRectangle(int x, int y, int width, int height, int argb);
+void simDrawCircle(int x0, int y0, int radius, int argb);
+
+// Batched writes of n scattered pixels, coordinates must be on screen
+void simPutPixels(const int *xs, const int *ys, const int *argb, int n);
+void simPutPixelsColor(const int *xs, const int *ys, int argb, int n);
 #endif
 
 extern void simInit();
 extern void app();
 extern void simExit();
 
+// Independent sim instances. Every thread draws into its current context,
+// simInit creates one if the thread has none. Creating a context aborts
+// when out of memory
+typedef struct SimContext SimContext;
+SimContext *simContextCreate(void);
+void simContextDestroy(SimContext *ctx);
+void simContextMakeCurrent(SimContext *ctx);
+SimContext *simContextCurrent(void);
+// Runs simInit, entry and simExit with ctx current on the calling thread.
+// Returns the number of presented frames once entry returns or the
+// backend ends the run (e.g. SIM_FRAMES of the headless backend)
+unsigned long simContextRun(SimContext *ctx, void (*entry)(void));
+
 #ifdef __cplusplus
 }
 #endif
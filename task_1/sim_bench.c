@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "sim_core.h"
+
+// Times the app.c drawing kernels as they are (per-pixel simPutPixel), the
+// runtime primitives doing the same work and the whole app loop on every
+// sim backend and prints the results as JSON on stdout
+//   sim_bench [-w warmup] [-r repetitions] [-f app frames] [backend...]
+// Without backends given, headless is measured, plus sdl when it was
+// built and a display is available. Pacing is off for all runs, and the
+// sdl window closes after each run without waiting for the user
+
+void draw_circle(int x0, int y0, int radius, int argb);
+void draw_rectangle(int x, int y, int width, int height, int argb);
+
+#define WHITE 0xFFFFFFFF
+#define RED 0xFFFF0000
+#define BLACK 0x00000000
+
+typedef struct Sample
+{
+    uint64_t Frames;
+    uint64_t Pixels;
+    // Time in drawing code, and in drawing plus flushes
+    uint64_t DrawNs;
+    uint64_t FrameNs;
+} Sample;
+
+typedef struct Kernel
+{
+    const char *Name;
+    // Draws one frame worth of work, rep varies the positions
+    void (*Draw)(int rep);
+} Kernel;
+
+static int Warmup = 3;
+static int Repetitions = 10;
+static unsigned long AppFrames = 200;
+
+static const Kernel *CurrentKernel;
+static Sample *Samples;
+static SimCounters AppStartCount;
+static uint64_t AppStartFrameNs, AppStartDrawNs;
+
+static void drawCircles(int rep)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        int r = 8 + i % 64;
+        int x = r + (i * 97 + rep * 13) % (SIM_X_SIZE - 2 * r);
+        int y = r + (i * 61 + rep * 7) % (SIM_Y_SIZE - 2 * r);
+        draw_circle(x, y, r, i & 1 ? WHITE : RED);
+    }
+}
+
+static void drawRectangles(int rep)
+{
+    for (int i = 0; i < 64; i++)
+    {
+        int x = (i * 53 + rep * 7) % (SIM_X_SIZE - 120);
+        int y = (i * 37 + rep * 5) % (SIM_Y_SIZE - 90);
+        draw_rectangle(x, y, 120, 90, i & 1 ? WHITE : RED);
+    }
+}
+
+// Same circles and rectangles through the runtime primitives
+static void simCircles(int rep)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        int r = 8 + i % 64;
+        int x = r + (i * 97 + rep * 13) % (SIM_X_SIZE - 2 * r);
+        int y = r + (i * 61 + rep * 7) % (SIM_Y_SIZE - 2 * r);
+        simDrawCircle(x, y, r, i & 1 ? WHITE : RED);
+    }
+}
+
+static void simRectangles(int rep)
+{
+    for (int i = 0; i < 64; i++)
+    {
+        int x = (i * 53 + rep * 7) % (SIM_X_SIZE - 120);
+        int y = (i * 37 + rep * 5) % (SIM_Y_SIZE - 90);
+        simFillRect(x, y, 120, 90, i & 1 ? WHITE : RED);
+    }
+}
+
+static void clearFrame(int rep)
+{
+    simFillRect(0, 0, SIM_X_SIZE, SIM_Y_SIZE, rep & 1 ? BLACK : WHITE);
+}
+
+static const Kernel Kernels[] = {
+    {"draw_circle", drawCircles},
+    {"draw_rectangle", drawRectangles},
+    {"simDrawCircle", simCircles},
+    {"simFillRect", simRectangles},
+    {"clear", clearFrame},
+};
+
+// Context entry running all repetitions of CurrentKernel
+static void runKernel(void)
+{
+    SimContext *ctx = SimCurrent;
+    for (int i = 0; i < Warmup + Repetitions; i++)
+    {
+        uint64_t start = simNowNs();
+        CurrentKernel->Draw(i);
+        uint64_t drawn = simNowNs();
+        uint64_t pixels = ctx->Count.Pixels;
+        simFlush();
+        uint64_t end = simNowNs();
+        if (i >= Warmup)
+            Samples[i - Warmup] = (Sample){1, pixels, drawn - start, end - start};
+    }
+}
+
+// Context entry for the app loop, only frames after simInit are counted
+static void runApp(void)
+{
+    simStatsTotals(SimCurrent, &AppStartCount, &AppStartFrameNs, &AppStartDrawNs);
+    app();
+}
+
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void printSummary(const char *name, double *values, int n)
+{
+    qsort(values, n, sizeof(double), compareDouble);
+    double sum = 0, sq = 0;
+    for (int i = 0; i < n; i++)
+        sum += values[i];
+    double mean = sum / n;
+    for (int i = 0; i < n; i++)
+        sq += (values[i] - mean) * (values[i] - mean);
+    double median = n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+    printf("\"%s\": {\"min\": %.4f, \"median\": %.4f, \"mean\": %.4f, \"stddev\": %.4f, \"max\": %.4f}",
+           name, values[0], median, mean, n > 1 ? sqrt(sq / (n - 1)) : 0.0, values[n - 1]);
+}
+
+static void printResult(const char *backend, const char *bench, int first)
+{
+    double *nsPerPixel = malloc(Repetitions * sizeof(double));
+    double *fps = malloc(Repetitions * sizeof(double));
+    for (int i = 0; i < Repetitions; i++)
+    {
+        nsPerPixel[i] = Samples[i].Pixels ? (double)Samples[i].DrawNs / Samples[i].Pixels : 0.0;
+        fps[i] = Samples[i].FrameNs ? 1e9 * Samples[i].Frames / Samples[i].FrameNs : 0.0;
+    }
+    printf("%s\n    {\"backend\": \"%s\", \"bench\": \"%s\", \"frames\": %llu, \"pixels\": %llu, ",
+           first ? "" : ",", backend, bench, (unsigned long long)Samples[0].Frames,
+           (unsigned long long)Samples[0].Pixels);
+    printSummary("ns_per_pixel", nsPerPixel, Repetitions);
+    printf(", ");
+    printSummary("fps", fps, Repetitions);
+    printf("}");
+    fflush(stdout);
+    free(nsPerPixel);
+    free(fps);
+}
+
+static SimContext *newContext(void)
+{
+    SimContext *ctx = simContextCreate();
+    ctx->Quiet = 1;
+    ctx->CloseOnExit = 1;
+    return ctx;
+}
+
+static void benchBackend(const char *backend, int *first)
+{
+    setenv("SIM_BACKEND", backend, 1);
+    for (size_t k = 0; k < sizeof(Kernels) / sizeof(Kernels[0]); k++)
+    {
+        CurrentKernel = &Kernels[k];
+        SimContext *ctx = newContext();
+        simContextRun(ctx, runKernel);
+        simContextDestroy(ctx);
+        printResult(backend, CurrentKernel->Name, *first);
+        *first = 0;
+    }
+
+    for (int i = 0; i < Warmup + Repetitions; i++)
+    {
+        SimContext *ctx = newContext();
+        ctx->FrameLimit = AppFrames;
+        simContextRun(ctx, runApp);
+        SimCounters count;
+        uint64_t frameNs, drawNs;
+        simStatsTotals(ctx, &count, &frameNs, &drawNs);
+        if (i >= Warmup)
+            Samples[i - Warmup] = (Sample){AppFrames, count.Pixels - AppStartCount.Pixels,
+                                           drawNs - AppStartDrawNs, frameNs - AppStartFrameNs};
+        simContextDestroy(ctx);
+    }
+    printResult(backend, "app", *first);
+}
+
+static int knownBackend(const char *name)
+{
+#ifdef SIM_HAVE_SDL
+    if (!strcmp(name, SimSdlBackend.Name))
+        return 1;
+#endif
+    return !strcmp(name, SimHeadlessBackend.Name);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "w:r:f:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            Warmup = atoi(optarg);
+            break;
+        case 'r':
+            Repetitions = atoi(optarg);
+            break;
+        case 'f':
+            AppFrames = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-w warmup] [-r repetitions] [-f app frames] [backend...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (Warmup < 0 || Repetitions <= 0 || !AppFrames)
+    {
+        fprintf(stderr, "[ERROR] Need warmup >= 0, repetitions > 0 and app frames > 0\n");
+        return EXIT_FAILURE;
+    }
+
+    const char *defaults[2];
+    const char **backends = (const char **)argv + optind;
+    int backendCount = argc - optind;
+    if (!backendCount)
+    {
+        defaults[backendCount++] = SimHeadlessBackend.Name;
+#ifdef SIM_HAVE_SDL
+        if (getenv("DISPLAY") || getenv("WAYLAND_DISPLAY"))
+            defaults[backendCount++] = SimSdlBackend.Name;
+#endif
+        backends = defaults;
+    }
+    for (int i = 0; i < backendCount; i++)
+    {
+        if (!knownBackend(backends[i]))
+        {
+            fprintf(stderr, "[ERROR] Backend '%s' is not built in\n", backends[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Measure the drawing code alone: no pacing, no frame limit but ours,
+    // no recording or capture
+    setenv("SIM_FPS", "0", 1);
+    setenv("SIM_FRAMES", "0", 1);
+    unsetenv("SIM_STATS");
+    unsetenv("SIM_PERF");
+    unsetenv("SIM_RECORD");
+    unsetenv("SIM_CAPTURE");
+    unsetenv("SIM_DUMP");
+    simSeed(1);
+
+    Samples = calloc(Repetitions, sizeof(Sample));
+    printf("{\"screen\": {\"width\": %d, \"height\": %d}, \"warmup\": %d, \"repetitions\": %d, "
+           "\"app_frames\": %lu, \"results\": [",
+           SIM_X_SIZE, SIM_Y_SIZE, Warmup, Repetitions, AppFrames);
+    int first = 1;
+    for (int i = 0; i < backendCount; i++)
+        benchBackend(backends[i], &first);
+    printf("\n]}\n");
+    free(Samples);
+    return EXIT_SUCCESS;
+}
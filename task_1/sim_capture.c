@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_core.h"
+#include "sim_capture.h"
+
+// Frame capture, enabled with SIM_CAPTURE=path. Only dirty tiles are
+// compared with the copy of the previous frame, so a frame costs time
+// and bytes proportional to what actually changed
+
+// Shorter runs of one value are cheaper as part of a literal
+#define MIN_REPEAT 3
+// Longest run header: 5-byte varint and one value
+#define MAX_RUN_HEADER 9
+
+struct SimCapture
+{
+    FILE *Out;
+    // Payload of the frame being encoded
+    uint8_t *Data;
+    size_t Size;
+    size_t Capacity;
+    // First pixel not yet covered by a run
+    uint32_t Pos;
+    unsigned long Frames;
+    uint64_t Bytes;
+    uint32_t Previous[SIM_Y_SIZE][SIM_X_SIZE];
+};
+
+static uint8_t *reserve(SimCapture *c, size_t n)
+{
+    if (c->Size + n > c->Capacity)
+    {
+        size_t capacity = c->Capacity ? c->Capacity : 4096;
+        while (c->Size + n > capacity)
+            capacity *= 2;
+        uint8_t *data = realloc(c->Data, capacity);
+        if (!data)
+        {
+            // Half a frame can't be dropped from the stream
+            fprintf(stderr, "[SIM] Out of memory for a %zu byte capture frame\n", capacity);
+            abort();
+        }
+        c->Data = data;
+        c->Capacity = capacity;
+    }
+    return c->Data + c->Size;
+}
+
+static void putRun(SimCapture *c, int kind, uint32_t length)
+{
+    uint8_t *p = reserve(c, MAX_RUN_HEADER);
+    c->Size = simPutVarint(p, length << 2 | kind) - c->Data;
+}
+
+// Encodes changed pixels of one dirty span of a row
+static void encodeSpan(SimCapture *c, const uint32_t *cur, uint32_t *prev, uint32_t base, int x0, int x1)
+{
+    int x = x0;
+    while (x < x1)
+    {
+        uint32_t d = cur[x] ^ prev[x];
+        if (!d)
+        {
+            x++;
+            continue;
+        }
+        if (base + x > c->Pos)
+            putRun(c, SIM_RUN_SKIP, base + x - c->Pos);
+        int run = 1;
+        while (x + run < x1 && (cur[x + run] ^ prev[x + run]) == d)
+            run++;
+        if (run >= MIN_REPEAT)
+        {
+            putRun(c, SIM_RUN_REPEAT, run);
+            c->Size = simPut32(c->Data + c->Size, d) - c->Data;
+        }
+        else
+        {
+            // Literal until the changes stop or a repeat is worth starting
+            int end = x + run;
+            while (end < x1 && (d = cur[end] ^ prev[end]))
+            {
+                run = 1;
+                while (end + run < x1 && (cur[end + run] ^ prev[end + run]) == d)
+                    run++;
+                if (run >= MIN_REPEAT)
+                    break;
+                end += run;
+            }
+            run = end - x;
+            putRun(c, SIM_RUN_LITERAL, run);
+            uint8_t *p = reserve(c, 4 * (size_t)run);
+            for (int i = x; i < end; i++)
+                p = simPut32(p, cur[i] ^ prev[i]);
+            c->Size = p - c->Data;
+        }
+        x += run;
+        c->Pos = base + x;
+    }
+    memcpy(prev + x0, cur + x0, (x1 - x0) * sizeof(uint32_t));
+}
+
+void simCaptureOpen(SimContext *ctx)
+{
+    const char *path = getenv("SIM_CAPTURE");
+    if (!path)
+        return;
+    char buf[4096];
+    path = simContextPath(ctx, path, buf, sizeof(buf));
+    SimCapture *c = calloc(1, sizeof(SimCapture));
+    if (!c || !(c->Out = fopen(path, "wb")))
+    {
+        fprintf(stderr, "[SIM] Can't open %s for writing\n", path);
+        free(c);
+        return;
+    }
+    uint8_t header[16];
+    memcpy(header, SIM_CAPTURE_MAGIC, 4);
+    header[4] = SIM_CAPTURE_VERSION;
+    uint8_t *p = simPutVarint(header + 5, SIM_X_SIZE);
+    p = simPutVarint(p, SIM_Y_SIZE);
+    fwrite(header, 1, p - header, c->Out);
+    ctx->Capture = c;
+}
+
+void simCaptureFrame(SimContext *ctx)
+{
+    SimCapture *c = ctx->Capture;
+    c->Size = 0;
+    c->Pos = 0;
+    for (int ty = 0; ty < SIM_TILES_Y; ty++)
+    {
+        uint32_t tiles = ctx->DirtyTiles[ty];
+        if (!tiles)
+            continue;
+        int y1 = (ty + 1) * SIM_TILE_SIZE;
+        if (y1 > SIM_Y_SIZE)
+            y1 = SIM_Y_SIZE;
+        for (int y = ty * SIM_TILE_SIZE; y < y1; y++)
+        {
+            uint32_t row = tiles;
+            while (row)
+            {
+                int tx0 = __builtin_ctz(row);
+                int tx1 = tx0;
+                while (tx1 + 1 < SIM_TILES_X && (row >> (tx1 + 1)) & 1)
+                    tx1++;
+                row &= ~(uint32_t)((2ull << tx1) - (1ull << tx0));
+                int x1 = (tx1 + 1) * SIM_TILE_SIZE;
+                encodeSpan(c, ctx->Framebuffer[y], c->Previous[y], (uint32_t)y * SIM_X_SIZE,
+                           tx0 * SIM_TILE_SIZE, x1 > SIM_X_SIZE ? SIM_X_SIZE : x1);
+            }
+        }
+    }
+    uint8_t header[8];
+    uint8_t *p = simPutVarint(header, (uint32_t)c->Size);
+    fwrite(header, 1, p - header, c->Out);
+    fwrite(c->Data, 1, c->Size, c->Out);
+    c->Frames++;
+    c->Bytes += (p - header) + c->Size;
+}
+
+void simCaptureClose(SimContext *ctx)
+{
+    SimCapture *c = ctx->Capture;
+    if (!c)
+        return;
+    fclose(c->Out);
+    fprintf(stderr, "[SIM] captured %lu frames, %llu bytes, %.1f bytes/frame\n", c->Frames,
+            (unsigned long long)c->Bytes, c->Frames ? (double)c->Bytes / c->Frames : 0.0);
+    free(c->Data);
+    free(c);
+    ctx->Capture = NULL;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+#include "sim_record.h"
+
+// Frame capture stream, written by sim_capture.c and read by sim_decode.c
+//
+// Header: "SIMC", version byte, then screen width and height as varints.
+// Every presented frame follows as a varint payload size and the payload.
+// The payload describes the XOR of the frame with the previous one (the
+// first frame is compared to all black) in row-major pixel order as a
+// list of runs. Each run starts with varint (length << 2 | kind):
+//   SIM_RUN_SKIP     length unchanged pixels
+//   SIM_RUN_REPEAT   length pixels XORed with one 32-bit little endian value
+//   SIM_RUN_LITERAL  length 32-bit little endian XOR values
+// Pixels after the last run are unchanged
+
+#define SIM_CAPTURE_MAGIC "SIMC"
+#define SIM_CAPTURE_VERSION 1
+
+enum SimCaptureRun
+{
+    SIM_RUN_SKIP = 0,
+    SIM_RUN_REPEAT,
+    SIM_RUN_LITERAL,
+};
+
+static inline uint8_t *simPut32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+    return p + 4;
+}
+
+static inline uint32_t simGet32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
@@ -0,0 +1,184 @@
+#pragma once
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sim.h"
+
+// Internal interface shared by sim.c and the backends, not part of the
+// public sim.h API
+
+// Changed pixels are tracked in 32x32 tiles, one bit per tile column
+#define SIM_TILE_SHIFT 5
+#define SIM_TILE_SIZE (1 << SIM_TILE_SHIFT)
+#define SIM_TILES_X ((SIM_X_SIZE + SIM_TILE_SIZE - 1) / SIM_TILE_SIZE)
+#define SIM_TILES_Y ((SIM_Y_SIZE + SIM_TILE_SIZE - 1) / SIM_TILE_SIZE)
+#define SIM_MAX_DIRTY_RECTS (SIM_TILES_X * SIM_TILES_Y)
+
+_Static_assert(SIM_TILES_X <= 32, "Dirty tile row must fit in uint32_t");
+
+typedef struct SimRect
+{
+    int x, y, w, h;
+} SimRect;
+
+typedef struct SimBackend
+{
+    const char *Name;
+    void (*Init)(SimContext *ctx);
+    // Framebuffer regions changed since the previous present. Returns 0
+    // when the run should end after this frame
+    int (*Present)(SimContext *ctx, const SimRect *dirty, int count);
+    void (*Exit)(SimContext *ctx);
+} SimBackend;
+
+extern const SimBackend SimHeadlessBackend;
+#ifdef SIM_HAVE_SDL
+extern const SimBackend SimSdlBackend;
+#endif
+
+typedef struct SimCounters
+{
+    uint64_t Pixels;
+    uint64_t Calls;
+} SimCounters;
+
+// simRand generator state, sim.c
+typedef struct SimRandState
+{
+    uint32_t State[4];
+    // Seed generation the state was seeded for, 0 - not seeded yet
+    unsigned Generation;
+    unsigned Stream;
+} SimRandState;
+
+typedef struct SimStats SimStats;
+typedef struct SimRecorder SimRecorder;
+typedef struct SimCapture SimCapture;
+
+// Everything one sim instance owns, the public API works on the context
+// current for the calling thread
+struct SimContext
+{
+    int Id;
+    const SimBackend *Backend;
+    void *BackendState;
+    // ARGB8888 frame written by the drawing calls, backends read it on
+    // present. Points to the back buffer of Buffers, see simSwapBuffers
+    uint32_t (*Framebuffer)[SIM_X_SIZE];
+    uint32_t (*Buffers)[SIM_Y_SIZE][SIM_X_SIZE];
+    // Dirty tile bitmask, bit i of row j covers tile (i, j)
+    uint32_t DirtyTiles[SIM_TILES_Y];
+    // Number of frames presented so far
+    unsigned long Frame;
+    // Ends the run after this many frames whatever the backend says, 0 -
+    // no limit. Set by tools driving contexts directly
+    unsigned long FrameLimit;
+    // Skips the summary on exit
+    int Quiet;
+    // Closes the backend on exit right away instead of keeping the window
+    // open until the user closes it. Set by tools driving contexts directly
+    int CloseOnExit;
+    // Counters of the frame being drawn
+    SimCounters Count;
+    // simRand stream of the context, seeded from its id
+    SimRandState Rand;
+    // Frame scheduler, sim_sched.c
+    uint64_t FramePeriod;
+    uint64_t NextDeadline;
+    SimStats *Stats;
+    // Set while the call stream is recorded
+    SimRecorder *Record;
+    // Set while presented frames are captured
+    SimCapture *Capture;
+    // Set by simContextRun, the end of a run jumps back there
+    jmp_buf *Done;
+};
+
+extern _Thread_local SimContext *SimCurrent;
+
+int simWritePPM(SimContext *ctx, const char *path);
+
+// Output file name for ctx: the path itself for context 0, otherwise the
+// context id is inserted before the extension (frames.csv -> frames-3.csv)
+const char *simContextPath(const SimContext *ctx, const char *path, char *buf, int size);
+
+// Checks frame against a comma separated list of numbers and ranges
+// (SIM_DUMP syntax: 1,5,10-20)
+int simFrameListed(const char *list, unsigned long frame);
+
+// Zeroed allocation for state the runtime can't work without, reports
+// what it was for and aborts when out of memory
+void *simCalloc(size_t count, size_t size, const char *what);
+
+// Seeds from SIM_SEED (or the clock) once per process
+void simSeedFromEnv(void);
+
+// Makes the other buffer the drawing target and brings it up to date with
+// the dirty regions of the frame just handed to the backend. The previous
+// buffer stays readable until the next swap
+void simSwapBuffers(SimContext *ctx, const SimRect *dirty, int count);
+
+// Frame scheduler, sim_sched.c
+uint64_t simNowNs(void);
+void simSchedInit(SimContext *ctx);
+// Sleeps until the next frame deadline, used by pacing backends only
+void simSchedWait(SimContext *ctx);
+// The two halves of simSchedWait for backends presenting on another
+// thread: simSchedNext advances the cadence of ctx on the app thread and
+// returns the deadline (0 - none), simSleepUntil sleeps until it on any
+// thread and returns -1 after reporting an error, then pacing should stop
+uint64_t simSchedNext(SimContext *ctx);
+int simSleepUntil(uint64_t deadline);
+
+// Frame statistics, sim_stats.c
+void simStatsInit(SimContext *ctx);
+void simStatsFlushBegin(SimContext *ctx);
+void simStatsFlushEnd(SimContext *ctx, uint64_t uploadBytes);
+void simStatsReport(SimContext *ctx);
+// Pixels and draw calls of all frames so far, their total time and the
+// part of it spent in app code between flushes
+void simStatsTotals(SimContext *ctx, SimCounters *count, uint64_t *frameNs, uint64_t *appNs);
+void simStatsDestroy(SimContext *ctx);
+
+// perf_event counters of the calling thread, sim_perf.c. Enabled for the
+// stats with SIM_PERF=1
+#define SIM_PERF_MAX 4
+typedef struct SimPerf SimPerf;
+SimPerf *simPerfOpen(void);
+int simPerfCount(const SimPerf *perf);
+const char *simPerfName(const SimPerf *perf, int i);
+void simPerfRead(SimPerf *perf, uint64_t *values);
+void simPerfClose(SimPerf *perf);
+
+// Call stream recorder, sim_record.c
+void simRecordOpen(SimContext *ctx);
+void simRecordClose(SimContext *ctx);
+void simRecordPixel(SimRecorder *r, int x, int y, int argb);
+void simRecordPixels(SimRecorder *r, const int *xs, const int *ys, const int *argb, int n);
+void simRecordPixelsColor(SimRecorder *r, const int *xs, const int *ys, int argb, int n);
+void simRecordFill(SimRecorder *r, int x, int y, int width, int height, int argb);
+void simRecordCircle(SimRecorder *r, int x0, int y0, int radius, int argb);
+void simRecordFlush(SimRecorder *r);
+void simRecordRand(SimRecorder *r, int value);
+
+// Frame capture, sim_capture.c. simCaptureFrame encodes the dirty tiles
+// of the frame about to be presented
+void simCaptureOpen(SimContext *ctx);
+void simCaptureFrame(SimContext *ctx);
+void simCaptureClose(SimContext *ctx);
+
+// Marks the tiles covering pixels [x0, x1] x [y0, y1] as changed,
+// coordinates must already be clipped to the screen
+static inline void simMarkDirty(SimContext *ctx, int x0, int y0, int x1, int y1)
+{
+    int tx0 = x0 >> SIM_TILE_SHIFT;
+    int tx1 = x1 >> SIM_TILE_SHIFT;
+    uint32_t mask = (uint32_t)((2ull << tx1) - (1ull << tx0));
+    for (int ty = y0 >> SIM_TILE_SHIFT; ty <= y1 >> SIM_TILE_SHIFT; ty++)
+        ctx->DirtyTiles[ty] |= mask;
+}
+
+static inline void simMarkDirtyPixel(SimContext *ctx, int x, int y)
+{
+    ctx->DirtyTiles[y >> SIM_TILE_SHIFT] |= 1u << (x >> SIM_TILE_SHIFT);
+}
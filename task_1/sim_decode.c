@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_core.h"
+#include "sim_capture.h"
+#include "sim_file.h"
+
+// Rebuilds frames of a SIM_CAPTURE stream and prints its size summary.
+// Frames listed in SIM_DUMP are written as PPM like the headless backend
+// does, so a decoded frame compares byte for byte with a direct dump
+
+// Applies one frame payload to fb, returns 0 on malformed input
+static int decodeFrame(uint32_t *fb, const uint8_t *p, const uint8_t *end)
+{
+    const uint32_t total = SIM_X_SIZE * SIM_Y_SIZE;
+    uint32_t pos = 0;
+    while (p < end)
+    {
+        uint32_t run;
+        if (!(p = simGetVarint(p, end, &run)))
+            return 0;
+        uint32_t length = run >> 2;
+        if (length > total - pos)
+            return 0;
+        switch (run & 3)
+        {
+        case SIM_RUN_SKIP:
+            break;
+        case SIM_RUN_REPEAT:
+        {
+            if (end - p < 4)
+                return 0;
+            uint32_t d = simGet32(p);
+            p += 4;
+            for (uint32_t i = pos; i < pos + length; i++)
+                fb[i] ^= d;
+            break;
+        }
+        case SIM_RUN_LITERAL:
+            if ((size_t)(end - p) < 4 * (size_t)length)
+                return 0;
+            for (uint32_t i = pos; i < pos + length; i++, p += 4)
+                fb[i] ^= simGet32(p);
+            break;
+        default:
+            return 0;
+        }
+        pos += length;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <sim capture>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    size_t size = 0;
+    uint8_t *data = simReadFile(argv[1], &size);
+    if (!data)
+    {
+        fprintf(stderr, "[ERROR] Can't read %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    const uint8_t *end = data + size;
+    const uint8_t *p = data + 5;
+    uint32_t width = 0, height = 0;
+    if (size < 5 || memcmp(data, SIM_CAPTURE_MAGIC, 4) || data[4] != SIM_CAPTURE_VERSION ||
+        !(p = simGetVarint(p, end, &width)) || !(p = simGetVarint(p, end, &height)))
+    {
+        fprintf(stderr, "[ERROR] %s is not a sim capture\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (width != SIM_X_SIZE || height != SIM_Y_SIZE)
+    {
+        fprintf(stderr, "[ERROR] Capture is %ux%u, sim is %dx%d\n", width, height, SIM_X_SIZE, SIM_Y_SIZE);
+        return EXIT_FAILURE;
+    }
+
+    SimContext *ctx = simContextCreate();
+    const char *dumpList = getenv("SIM_DUMP");
+    const char *prefix = getenv("SIM_DUMP_PREFIX");
+    if (!prefix)
+        prefix = "frame_";
+    unsigned long frame = 0;
+    uint32_t minSize = UINT32_MAX, maxSize = 0;
+    uint64_t payload = 0;
+    for (; p < end; frame++)
+    {
+        uint32_t frameSize;
+        if (!(p = simGetVarint(p, end, &frameSize)) || frameSize > (size_t)(end - p) ||
+            !decodeFrame(&ctx->Framebuffer[0][0], p, p + frameSize))
+        {
+            fprintf(stderr, "[ERROR] Capture is corrupt at frame %lu\n", frame);
+            return EXIT_FAILURE;
+        }
+        p += frameSize;
+        payload += frameSize;
+        if (frameSize < minSize)
+            minSize = frameSize;
+        if (frameSize > maxSize)
+            maxSize = frameSize;
+        if (dumpList && simFrameListed(dumpList, frame))
+        {
+            char name[4096];
+            snprintf(name, sizeof(name), "%s%05lu.ppm", prefix, frame);
+            simWritePPM(ctx, name);
+        }
+    }
+    double raw = (double)frame * SIM_X_SIZE * SIM_Y_SIZE * sizeof(uint32_t);
+    fprintf(stderr, "[DECODE] %lu frames, %zu bytes (%.0fx smaller than raw)\n", frame, size,
+            size ? raw / size : 0.0);
+    if (frame)
+        fprintf(stderr, "[DECODE] frame payload min %u avg %.1f max %u bytes\n", minSize,
+                (double)payload / frame, maxSize);
+    simContextDestroy(ctx);
+    free(data);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,24 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "sim_file.h"
+
+uint8_t *simReadFile(const char *path, size_t *size)
+{
+    FILE *in = fopen(path, "rb");
+    if (!in)
+        return NULL;
+    long length = -1;
+    if (!fseek(in, 0, SEEK_END))
+        length = ftell(in);
+    uint8_t *data = NULL;
+    if (length >= 0 && !fseek(in, 0, SEEK_SET))
+        data = malloc(length ? length : 1);
+    if (data && fread(data, 1, length, in) != (size_t)length)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(in);
+    *size = data ? (size_t)length : 0;
+    return data;
+}
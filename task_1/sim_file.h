@@ -0,0 +1,18 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Whole-file reads for the tools decoding sim and trace streams
+// (sim_replay, sim_decode, task_2/trace_decode)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Reads path into a malloc'ed buffer and stores its length in size.
+// Returns NULL when the file can't be opened or read
+uint8_t *simReadFile(const char *path, size_t *size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_core.h"
+
+// Headless backend: frames stay in memory, nothing sleeps
+//   SIM_FRAMES=N        stop after N frames (default 1000, 0 - never stop)
+//   SIM_DUMP=1,5,10-20  frames to dump as PPM
+//   SIM_DUMP_PREFIX=p   dump file prefix, frames go to <p>NNNNN.ppm, other
+//                       contexts than the first one add their id: <p>NNNNN-id.ppm
+
+#define DEFAULT_FRAMES 1000
+
+typedef struct HeadlessState
+{
+    unsigned long MaxFrames;
+    const char *DumpList;
+    const char *DumpPrefix;
+} HeadlessState;
+
+static void headlessInit(SimContext *ctx)
+{
+    HeadlessState *state = simCalloc(1, sizeof(HeadlessState), "the headless backend");
+    const char *frames = getenv("SIM_FRAMES");
+    state->MaxFrames = frames ? strtoul(frames, NULL, 10) : DEFAULT_FRAMES;
+    state->DumpList = getenv("SIM_DUMP");
+    const char *prefix = getenv("SIM_DUMP_PREFIX");
+    state->DumpPrefix = prefix ? prefix : "frame_";
+    ctx->BackendState = state;
+}
+
+static void headlessExit(SimContext *ctx)
+{
+    free(ctx->BackendState);
+    ctx->BackendState = NULL;
+}
+
+static int headlessPresent(SimContext *ctx, const SimRect *dirty, int count)
+{
+    HeadlessState *state = ctx->BackendState;
+    (void)dirty;
+    (void)count;
+    if (state->DumpList && simFrameListed(state->DumpList, ctx->Frame))
+    {
+        char name[4096], buf[4096];
+        snprintf(name, sizeof(name), "%s%05lu.ppm", state->DumpPrefix, ctx->Frame);
+        simWritePPM(ctx, simContextPath(ctx, name, buf, sizeof(buf)));
+    }
+    // simInit presents frame 0 itself, app frames are counted from 1
+    return !state->MaxFrames || ctx->Frame < state->MaxFrames;
+}
+
+const SimBackend SimHeadlessBackend = {"headless", headlessInit, headlessPresent, headlessExit};
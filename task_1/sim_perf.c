@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "sim_core.h"
+
+// perf_event counters of the calling thread, user space only. Hardware
+// counters are opened as one group so they cover the same interval; when
+// the PMU is not available (VMs, perf_event_paranoid) the software
+// task-clock is used instead
+
+struct SimPerf
+{
+    int Count;
+    int Fds[SIM_PERF_MAX];
+    const char *Names[SIM_PERF_MAX];
+};
+
+typedef struct PerfEvent
+{
+    const char *Name;
+    uint32_t Type;
+    uint64_t Config;
+} PerfEvent;
+
+static const PerfEvent HardwareEvents[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static const PerfEvent TaskClock = {"task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK};
+
+static int openEvent(const PerfEvent *event, int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event->Type;
+    attr.config = event->Config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = group < 0;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+SimPerf *simPerfOpen(void)
+{
+    SimPerf *perf = calloc(1, sizeof(SimPerf));
+    if (!perf)
+    {
+        fprintf(stderr, "[SIM] Out of memory for perf counters\n");
+        return NULL;
+    }
+    int leader = openEvent(&HardwareEvents[0], -1);
+    if (leader >= 0)
+    {
+        perf->Fds[perf->Count] = leader;
+        perf->Names[perf->Count++] = HardwareEvents[0].Name;
+        // Members the CPU does not support are left out
+        for (size_t i = 1; i < sizeof(HardwareEvents) / sizeof(HardwareEvents[0]); i++)
+        {
+            int fd = openEvent(&HardwareEvents[i], leader);
+            if (fd < 0)
+                continue;
+            perf->Fds[perf->Count] = fd;
+            perf->Names[perf->Count++] = HardwareEvents[i].Name;
+        }
+    }
+    else
+    {
+        int error = errno;
+        leader = openEvent(&TaskClock, -1);
+        if (leader < 0)
+        {
+            fprintf(stderr, "[SIM] perf_event_open failed: %s\n", strerror(errno));
+            free(perf);
+            return NULL;
+        }
+        fprintf(stderr, "[SIM] Hardware counters unavailable (%s), using task-clock\n", strerror(error));
+        perf->Fds[perf->Count] = leader;
+        perf->Names[perf->Count++] = TaskClock.Name;
+    }
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return perf;
+}
+
+int simPerfCount(const SimPerf *perf)
+{
+    return perf->Count;
+}
+
+const char *simPerfName(const SimPerf *perf, int i)
+{
+    return perf->Names[i];
+}
+
+// Running totals, scaled up when the kernel had to multiplex the group
+void simPerfRead(SimPerf *perf, uint64_t *values)
+{
+    uint64_t data[3 + SIM_PERF_MAX];
+    if (read(perf->Fds[0], data, sizeof(data)) < (ssize_t)(3 * sizeof(uint64_t)))
+        return;
+    uint64_t enabled = data[1];
+    uint64_t running = data[2];
+    for (int i = 0; i < perf->Count && i < (int)data[0]; i++)
+    {
+        uint64_t value = data[3 + i];
+        if (running && running < enabled)
+            value = (uint64_t)((double)value * enabled / running);
+        values[i] = value;
+    }
+}
+
+void simPerfClose(SimPerf *perf)
+{
+    if (!perf)
+        return;
+    for (int i = 0; i < perf->Count; i++)
+        close(perf->Fds[i]);
+    free(perf);
+}
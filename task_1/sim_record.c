@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "sim_core.h"
+#include "sim_record.h"
+
+// Call stream recorder, enabled with SIM_RECORD=path
+
+#define RECORD_BUFFER_SIZE (1 << 16)
+// Longest single entry: opcode and four 5-byte varints
+#define RECORD_MAX_ENTRY 32
+
+struct SimRecorder
+{
+    FILE *Out;
+    uint8_t *Pos;
+    int LastX;
+    int LastY;
+    uint32_t LastColor;
+    uint8_t Buffer[RECORD_BUFFER_SIZE];
+};
+
+static void drain(SimRecorder *r)
+{
+    fwrite(r->Buffer, 1, r->Pos - r->Buffer, r->Out);
+    r->Pos = r->Buffer;
+}
+
+static inline void reserve(SimRecorder *r)
+{
+    if (r->Pos + RECORD_MAX_ENTRY > r->Buffer + RECORD_BUFFER_SIZE)
+        drain(r);
+}
+
+static inline void putColor(SimRecorder *r, uint32_t argb)
+{
+    if (argb == r->LastColor)
+        return;
+    reserve(r);
+    *r->Pos++ = SIM_OP_COLOR;
+    r->Pos = simPutVarint(r->Pos, argb);
+    r->LastColor = argb;
+}
+
+static inline void putDelta(SimRecorder *r, int x, int y)
+{
+    r->Pos = simPutVarint(r->Pos, simZigzag(x - r->LastX));
+    r->Pos = simPutVarint(r->Pos, simZigzag(y - r->LastY));
+    r->LastX = x;
+    r->LastY = y;
+}
+
+void simRecordOpen(SimContext *ctx)
+{
+    const char *path = getenv("SIM_RECORD");
+    if (!path)
+        return;
+    char buf[4096];
+    path = simContextPath(ctx, path, buf, sizeof(buf));
+    SimRecorder *r = calloc(1, sizeof(SimRecorder));
+    if (!r)
+    {
+        fprintf(stderr, "[SIM] Out of memory, not recording to %s\n", path);
+        return;
+    }
+    r->Out = fopen(path, "wb");
+    if (!r->Out)
+    {
+        fprintf(stderr, "[SIM] Can't open %s for writing\n", path);
+        free(r);
+        return;
+    }
+    r->Pos = r->Buffer;
+    fwrite(SIM_RECORD_MAGIC, 1, 4, r->Out);
+    *r->Pos++ = SIM_RECORD_VERSION;
+    r->Pos = simPutVarint(r->Pos, SIM_X_SIZE);
+    r->Pos = simPutVarint(r->Pos, SIM_Y_SIZE);
+    ctx->Record = r;
+}
+
+void simRecordClose(SimContext *ctx)
+{
+    SimRecorder *r = ctx->Record;
+    if (!r)
+        return;
+    drain(r);
+    fclose(r->Out);
+    free(r);
+    ctx->Record = NULL;
+}
+
+void simRecordPixel(SimRecorder *r, int x, int y, int argb)
+{
+    putColor(r, argb);
+    reserve(r);
+    *r->Pos++ = SIM_OP_PIXEL;
+    putDelta(r, x, y);
+}
+
+void simRecordPixels(SimRecorder *r, const int *xs, const int *ys, const int *argb, int n)
+{
+    reserve(r);
+    *r->Pos++ = SIM_OP_PIXELS;
+    r->Pos = simPutVarint(r->Pos, n);
+    for (int i = 0; i < n; i++)
+    {
+        reserve(r);
+        putDelta(r, xs[i], ys[i]);
+        r->Pos = simPutVarint(r->Pos, argb[i]);
+    }
+}
+
+void simRecordPixelsColor(SimRecorder *r, const int *xs, const int *ys, int argb, int n)
+{
+    putColor(r, argb);
+    reserve(r);
+    *r->Pos++ = SIM_OP_PIXELS_COLOR;
+    r->Pos = simPutVarint(r->Pos, n);
+    for (int i = 0; i < n; i++)
+    {
+        reserve(r);
+        putDelta(r, xs[i], ys[i]);
+    }
+}
+
+void simRecordFill(SimRecorder *r, int x, int y, int width, int height, int argb)
+{
+    putColor(r, argb);
+    reserve(r);
+    *r->Pos++ = SIM_OP_FILL;
+    r->Pos = simPutVarint(r->Pos, simZigzag(x));
+    r->Pos = simPutVarint(r->Pos, simZigzag(y));
+    r->Pos = simPutVarint(r->Pos, simZigzag(width));
+    r->Pos = simPutVarint(r->Pos, simZigzag(height));
+}
+
+void simRecordCircle(SimRecorder *r, int x0, int y0, int radius, int argb)
+{
+    putColor(r, argb);
+    reserve(r);
+    *r->Pos++ = SIM_OP_CIRCLE;
+    r->Pos = simPutVarint(r->Pos, simZigzag(x0));
+    r->Pos = simPutVarint(r->Pos, simZigzag(y0));
+    r->Pos = simPutVarint(r->Pos, simZigzag(radius));
+}
+
+void simRecordFlush(SimRecorder *r)
+{
+    reserve(r);
+    *r->Pos++ = SIM_OP_FLUSH;
+}
+
+void simRecordRand(SimRecorder *r, int value)
+{
+    reserve(r);
+    *r->Pos++ = SIM_OP_RAND;
+    r->Pos = simPutVarint(r->Pos, value);
+}
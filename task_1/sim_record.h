@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+
+// Binary log of sim calls, written by sim_record.c and read by sim_replay.c
+//
+// Header: "SIMR", version byte, then screen width and height as varints.
+// Every call is an opcode byte followed by varint operands, signed values
+// are zigzag encoded. Pixel coordinates are deltas from the previous
+// pixel, the color is sent only when it changes (SIM_OP_COLOR)
+
+#define SIM_RECORD_MAGIC "SIMR"
+#define SIM_RECORD_VERSION 1
+
+enum SimRecordOp
+{
+    SIM_OP_COLOR = 1,        // argb
+    SIM_OP_PIXEL,            // dx dy
+    SIM_OP_PIXELS,           // n, n x (dx dy argb)
+    SIM_OP_PIXELS_COLOR,     // n, n x (dx dy), color from SIM_OP_COLOR
+    SIM_OP_FILL,             // x y w h, color from SIM_OP_COLOR
+    SIM_OP_CIRCLE,           // x y r, color from SIM_OP_COLOR
+    SIM_OP_FLUSH,
+    SIM_OP_RAND,             // value returned to the app
+};
+
+static inline uint32_t simZigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t simUnzigzag(uint32_t v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static inline uint8_t *simPutVarint(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+// Returns NULL on truncated input
+static inline const uint8_t *simGetVarint(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+    uint32_t result = 0;
+    for (int shift = 0; shift < 35 && p < end; shift += 7)
+    {
+        uint8_t byte = *p++;
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            *v = result;
+            return p;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_core.h"
+#include "sim_record.h"
+#include "sim_file.h"
+
+// Feeds a SIM_RECORD log back through the sim API as fast as possible.
+// The backend is chosen the usual way (SIM_BACKEND), pacing is off unless
+// SIM_FPS is set explicitly
+
+static int *growTo(int *array, size_t *capacity, size_t n)
+{
+    if (n <= *capacity)
+        return array;
+    int *grown = realloc(array, n * sizeof(int));
+    if (!grown)
+    {
+        fprintf(stderr, "[ERROR] Out of memory for a batch of %zu pixels\n", n);
+        exit(EXIT_FAILURE);
+    }
+    *capacity = n;
+    return grown;
+}
+
+#define GET(v)                                                   \
+    do                                                           \
+    {                                                            \
+        if (!(p = simGetVarint(p, end, &(v))))                   \
+            goto truncated;                                      \
+    } while (0)
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <sim record>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    size_t size = 0;
+    uint8_t *data = simReadFile(argv[1], &size);
+    if (!data)
+    {
+        fprintf(stderr, "[ERROR] Can't read %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    const uint8_t *end = data + size;
+    const uint8_t *p = data + 5;
+    uint32_t width = 0, height = 0;
+    if (size < 5 || memcmp(data, SIM_RECORD_MAGIC, 4) || data[4] != SIM_RECORD_VERSION ||
+        !(p = simGetVarint(p, end, &width)) || !(p = simGetVarint(p, end, &height)))
+    {
+        fprintf(stderr, "[ERROR] %s is not a sim record\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (width != SIM_X_SIZE || height != SIM_Y_SIZE)
+    {
+        fprintf(stderr, "[ERROR] Record is %ux%u, sim is %dx%d\n", width, height, SIM_X_SIZE, SIM_Y_SIZE);
+        return EXIT_FAILURE;
+    }
+
+    // The record decides when the replay ends, not the headless frame limit
+    setenv("SIM_FPS", "0", 0);
+    setenv("SIM_FRAMES", "0", 1);
+    setenv("SIM_SEED", "0", 0);
+    unsetenv("SIM_RECORD");
+    simInit();
+
+    int *xs = NULL, *ys = NULL, *colors = NULL;
+    size_t xsCap = 0, ysCap = 0, colorsCap = 0;
+    int x = 0, y = 0;
+    uint32_t color = 0;
+    unsigned long calls = 0, frames = 0;
+    uint64_t start = simNowNs();
+    while (p < end)
+    {
+        uint32_t a, b, c, d, n;
+        uint8_t op = *p++;
+        calls++;
+        switch (op)
+        {
+        case SIM_OP_COLOR:
+            GET(color);
+            calls--;
+            break;
+        case SIM_OP_PIXEL:
+            GET(a);
+            GET(b);
+            x += simUnzigzag(a);
+            y += simUnzigzag(b);
+            simPutPixel(x, y, color);
+            break;
+        case SIM_OP_PIXELS:
+        case SIM_OP_PIXELS_COLOR:
+            GET(n);
+            // Every pixel takes at least two bytes, larger counts are corrupt
+            if (n > (size_t)(end - p) / 2)
+                goto truncated;
+            xs = growTo(xs, &xsCap, n);
+            ys = growTo(ys, &ysCap, n);
+            if (op == SIM_OP_PIXELS)
+                colors = growTo(colors, &colorsCap, n);
+            for (uint32_t i = 0; i < n; i++)
+            {
+                GET(a);
+                GET(b);
+                xs[i] = x += simUnzigzag(a);
+                ys[i] = y += simUnzigzag(b);
+                if (op == SIM_OP_PIXELS)
+                {
+                    GET(c);
+                    colors[i] = c;
+                }
+            }
+            if (op == SIM_OP_PIXELS)
+                simPutPixels(xs, ys, colors, n);
+            else
+                simPutPixelsColor(xs, ys, color, n);
+            break;
+        case SIM_OP_FILL:
+            GET(a);
+            GET(b);
+            GET(c);
+            GET(d);
+            simFillRect(simUnzigzag(a), simUnzigzag(b), simUnzigzag(c), simUnzigzag(d), color);
+            break;
+        case SIM_OP_CIRCLE:
+            GET(a);
+            GET(b);
+            GET(c);
+            simDrawCircle(simUnzigzag(a), simUnzigzag(b), simUnzigzag(c), color);
+            break;
+        case SIM_OP_FLUSH:
+            simFlush();
+            frames++;
+            break;
+        case SIM_OP_RAND:
+            // The app already consumed the value, nothing to replay
+            GET(a);
+            break;
+        default:
+            fprintf(stderr, "[ERROR] Unknown opcode %u at offset %zu\n", op, (size_t)(p - 1 - data));
+            return EXIT_FAILURE;
+        }
+    }
+    double elapsed = (simNowNs() - start) / 1e9;
+    fprintf(stderr, "[REPLAY] %lu calls, %lu frames in %.3f s: %.0f calls/s, %.1f fps\n",
+            calls, frames, elapsed, calls / elapsed, frames / elapsed);
+    simExit();
+    return EXIT_SUCCESS;
+
+truncated:
+    fprintf(stderr, "[ERROR] Record is truncated\n");
+    return EXIT_FAILURE;
+}
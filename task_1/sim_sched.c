@@ -0,0 +1,70 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "sim_core.h"
+
+// Frame scheduler: absolute deadlines on the monotonic clock instead of
+// millisecond delays relative to the last present
+//   SIM_FPS=N  target frame rate (default 20), 0 - uncapped
+
+#define DEFAULT_FPS 20
+#define NS_PER_SEC 1000000000ull
+
+uint64_t simNowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+void simSchedInit(SimContext *ctx)
+{
+    const char *fps = getenv("SIM_FPS");
+    ctx->FramePeriod = NS_PER_SEC / DEFAULT_FPS;
+    if (fps)
+    {
+        long value = strtol(fps, NULL, 10);
+        ctx->FramePeriod = value > 0 ? NS_PER_SEC / value : 0;
+    }
+    ctx->NextDeadline = 0;
+}
+
+uint64_t simSchedNext(SimContext *ctx)
+{
+    uint64_t period = ctx->FramePeriod;
+    uint64_t deadline = ctx->NextDeadline;
+    if (!period)
+        return 0;
+    uint64_t now = simNowNs();
+    if (!deadline || now > deadline + period)
+    {
+        // First frame or more than a frame late: restart the cadence
+        // instead of rushing through the missed deadlines
+        deadline = now;
+    }
+    ctx->NextDeadline = deadline + period;
+    return deadline;
+}
+
+int simSleepUntil(uint64_t deadline)
+{
+    if (!deadline || simNowNs() >= deadline)
+        return 0;
+    struct timespec ts = {deadline / NS_PER_SEC, deadline % NS_PER_SEC};
+    int error;
+    while ((error = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) == EINTR)
+        ;
+    if (!error)
+        return 0;
+    fprintf(stderr, "[SIM] Can't sleep until the frame deadline: %s, pacing is off\n", strerror(error));
+    return -1;
+}
+
+void simSchedWait(SimContext *ctx)
+{
+    // Runs the rest of the frames unpaced instead of failing again
+    if (simSleepUntil(simSchedNext(ctx)))
+        ctx->FramePeriod = 0;
+}
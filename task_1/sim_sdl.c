@@ -0,0 +1,157 @@
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <SDL2/SDL.h>
+#include "sim_core.h"
+
+// SIM_ASYNC=1 moves upload and presentation to a presenter thread.
+// simFlush then only hands the finished buffer over and the app keeps
+// drawing into the other one. The window, its events and the frame
+// scheduler stay with the thread calling simInit, which SDL requires for
+// video on several platforms; the presenter gets the deadline of every
+// frame with the frame
+
+static SDL_Renderer *Renderer = NULL;
+static SDL_Window *Window = NULL;
+static SDL_Texture *Texture = NULL;
+// The window is process-wide, so only one context can use this backend
+static SimContext *Owner = NULL;
+
+static int Async = 0;
+static SDL_Thread *Presenter = NULL;
+static SDL_sem *FrameQueued = NULL; // app -> presenter: Front holds a frame
+static SDL_sem *FrameFree = NULL;   // presenter -> app: Front can be reused
+static atomic_int Exiting;
+// Set by the presenter when it can't sleep until a deadline
+static atomic_int PacingFailed;
+
+static struct
+{
+    uint32_t (*Pixels)[SIM_X_SIZE];
+    SimRect Dirty[SIM_MAX_DIRTY_RECTS];
+    int Count;
+    uint64_t Deadline;
+} Front;
+
+static void createSurface()
+{
+    SDL_CreateWindowAndRenderer(SIM_X_SIZE, SIM_Y_SIZE, 0, &Window, &Renderer);
+    Texture = SDL_CreateTexture(Renderer, SDL_PIXELFORMAT_ARGB8888,
+                                SDL_TEXTUREACCESS_STREAMING, SIM_X_SIZE, SIM_Y_SIZE);
+    SDL_SetRenderDrawColor(Renderer, 0, 0, 0, 0);
+    SDL_RenderClear(Renderer);
+}
+
+static void destroySurface()
+{
+    SDL_DestroyTexture(Texture);
+    SDL_DestroyRenderer(Renderer);
+    SDL_DestroyWindow(Window);
+}
+
+// Only the changed rectangles of the frame are uploaded, the streaming
+// texture keeps the rest from previous frames
+static void presentFrame(uint32_t (*pixels)[SIM_X_SIZE], const SimRect *dirty, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        SDL_Rect rect = {dirty[i].x, dirty[i].y, dirty[i].w, dirty[i].h};
+        SDL_UpdateTexture(Texture, &rect, &pixels[rect.y][rect.x],
+                          SIM_X_SIZE * sizeof(Uint32));
+    }
+    SDL_RenderCopy(Renderer, Texture, NULL, NULL);
+    SDL_RenderPresent(Renderer);
+}
+
+// Sleeps until the window is closed
+static void waitForQuit()
+{
+    SDL_Event event;
+    while (SDL_WaitEvent(&event))
+    {
+        if (event.type == SDL_QUIT)
+            return;
+    }
+    fprintf(stderr, "[SIM] Can't wait for SDL events: %s\n", SDL_GetError());
+}
+
+// Presents queued frames in order until sdlExit wakes it with Exiting set
+static int presenterMain(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        SDL_SemWait(FrameQueued);
+        if (atomic_load(&Exiting))
+            return 0;
+        if (simSleepUntil(Front.Deadline))
+            atomic_store(&PacingFailed, 1);
+        presentFrame(Front.Pixels, Front.Dirty, Front.Count);
+        SDL_SemPost(FrameFree);
+    }
+}
+
+static void sdlInit(SimContext *ctx)
+{
+    assert(!Owner && "SDL backend is already used by another context");
+    Owner = ctx;
+    SDL_Init(SDL_INIT_VIDEO);
+    createSurface();
+    const char *async = getenv("SIM_ASYNC");
+    Async = async && atoi(async);
+    if (!Async)
+        return;
+    atomic_store(&Exiting, 0);
+    atomic_store(&PacingFailed, 0);
+    FrameQueued = SDL_CreateSemaphore(0);
+    FrameFree = SDL_CreateSemaphore(1);
+    Presenter = SDL_CreateThread(presenterMain, "sim-presenter", NULL);
+    assert(Presenter && "Can't start presenter thread");
+}
+
+static void sdlExit(SimContext *ctx)
+{
+    if (Async)
+    {
+        // The last frame is presented before the presenter stops
+        SDL_SemWait(FrameFree);
+        atomic_store(&Exiting, 1);
+        SDL_SemPost(FrameQueued);
+        SDL_WaitThread(Presenter, NULL);
+        SDL_DestroySemaphore(FrameQueued);
+        SDL_DestroySemaphore(FrameFree);
+    }
+    // The window stays open until the user closes it
+    if (!ctx->CloseOnExit)
+        waitForQuit();
+    destroySurface();
+    SDL_Quit();
+    Owner = NULL;
+}
+
+static int sdlPresent(SimContext *ctx, const SimRect *dirty, int count)
+{
+    // The window was closed, sdlExit takes the event
+    SDL_PumpEvents();
+    if (SDL_HasEvent(SDL_QUIT))
+        return 0;
+    if (!Async)
+    {
+        simSchedWait(ctx);
+        presentFrame(ctx->Framebuffer, dirty, count);
+        return 1;
+    }
+    // Blocks only while the presenter still reads the previous frame
+    SDL_SemWait(FrameFree);
+    if (atomic_load(&PacingFailed))
+        ctx->FramePeriod = 0;
+    Front.Pixels = ctx->Framebuffer;
+    memcpy(Front.Dirty, dirty, count * sizeof(SimRect));
+    Front.Count = count;
+    Front.Deadline = simSchedNext(ctx);
+    SDL_SemPost(FrameQueued);
+    simSwapBuffers(ctx, dirty, count);
+    return 1;
+}
+
+const SimBackend SimSdlBackend = {"sdl", sdlInit, sdlPresent, sdlExit};
@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_core.h"
+
+// Per-frame counters and time histograms
+//   SIM_STATS=path  stream one record per frame, JSON lines when path ends
+//                   with .json, CSV otherwise
+//   SIM_PERF=1      count cycles, instructions, cache and branch misses
+//                   of the app code between flushes (sim_perf.c)
+
+// Log-linear histogram: 16 sub-buckets per power of two nanoseconds,
+// bucket bounds stay within ~6% of the recorded value
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef struct Histogram
+{
+    uint64_t Count;
+    uint64_t Sum;
+    uint64_t Max;
+    uint64_t Buckets[HIST_BUCKETS];
+} Histogram;
+
+struct SimStats
+{
+    SimCounters Total;
+    uint64_t TotalUpload;
+    Histogram FrameTime, AppTime, FlushTime;
+    uint64_t LastFlushEnd;
+    uint64_t FlushBegin;
+    FILE *Records;
+    int RecordsJson;
+    // perf counter totals at the end of the last flush and summed over
+    // the app part of all frames
+    SimPerf *Perf;
+    uint64_t PerfMark[SIM_PERF_MAX];
+    uint64_t PerfApp[SIM_PERF_MAX];
+    uint64_t PerfTotal[SIM_PERF_MAX];
+};
+
+static int bucketOf(uint64_t value)
+{
+    if (value < HIST_SUB)
+        return value;
+    int msb = 63 - __builtin_clzll(value);
+    int sub = (value >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+// Upper bound of the values falling into bucket
+static uint64_t bucketLimit(int bucket)
+{
+    if (bucket < HIST_SUB)
+        return bucket;
+    int msb = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket % HIST_SUB;
+    return ((HIST_SUB + sub + 1) << (msb - HIST_SUB_BITS)) - 1;
+}
+
+static void histAdd(Histogram *h, uint64_t value)
+{
+    h->Count++;
+    h->Sum += value;
+    if (value > h->Max)
+        h->Max = value;
+    h->Buckets[bucketOf(value)]++;
+}
+
+static uint64_t histPercentile(const Histogram *h, double p)
+{
+    uint64_t rank = (uint64_t)(p * h->Count);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->Buckets[i];
+        if (seen > rank)
+            return bucketLimit(i) < h->Max ? bucketLimit(i) : h->Max;
+    }
+    return h->Max;
+}
+
+static void histReport(const char *tag, const char *name, const Histogram *h)
+{
+    if (!h->Count)
+        return;
+    fprintf(stderr, "%s   %-6s avg %8.3f  p50 %8.3f  p95 %8.3f  p99 %8.3f  max %8.3f ms\n",
+            tag, name, (double)h->Sum / h->Count / 1e6, histPercentile(h, 0.50) / 1e6,
+            histPercentile(h, 0.95) / 1e6, histPercentile(h, 0.99) / 1e6, h->Max / 1e6);
+}
+
+static uint64_t perfTotal(const SimStats *stats, const char *name)
+{
+    for (int i = 0; i < simPerfCount(stats->Perf); i++)
+        if (!strcmp(simPerfName(stats->Perf, i), name))
+            return stats->PerfTotal[i];
+    return 0;
+}
+
+static void perfReport(const char *tag, const SimStats *stats, uint64_t frames)
+{
+    fprintf(stderr, "%s   app per frame:", tag);
+    for (int i = 0; i < simPerfCount(stats->Perf); i++)
+        fprintf(stderr, " %.0f %s", (double)stats->PerfTotal[i] / frames, simPerfName(stats->Perf, i));
+    fprintf(stderr, "\n");
+    uint64_t cycles = perfTotal(stats, "cycles");
+    uint64_t instructions = perfTotal(stats, "instructions");
+    if (!cycles || !instructions)
+        return;
+    fprintf(stderr, "%s   app IPC %.2f, cache misses %.2f / 1k instr, branch misses %.2f / 1k instr\n",
+            tag, (double)instructions / cycles, 1e3 * perfTotal(stats, "cache_misses") / instructions,
+            1e3 * perfTotal(stats, "branch_misses") / instructions);
+}
+
+void simStatsInit(SimContext *ctx)
+{
+    simStatsDestroy(ctx);
+    SimStats *stats = simCalloc(1, sizeof(SimStats), "frame statistics");
+    ctx->Stats = stats;
+    memset(&ctx->Count, 0, sizeof(ctx->Count));
+    const char *perf = getenv("SIM_PERF");
+    if (perf && atoi(perf))
+        stats->Perf = simPerfOpen();
+    if (stats->Perf)
+        simPerfRead(stats->Perf, stats->PerfMark);
+    stats->LastFlushEnd = simNowNs();
+    const char *path = getenv("SIM_STATS");
+    if (!path)
+        return;
+    char buf[4096];
+    path = simContextPath(ctx, path, buf, sizeof(buf));
+    stats->Records = fopen(path, "w");
+    if (!stats->Records)
+    {
+        fprintf(stderr, "[SIM] Can't open %s for writing\n", path);
+        return;
+    }
+    size_t len = strlen(path);
+    stats->RecordsJson = len >= 5 && !strcmp(path + len - 5, ".json");
+    if (!stats->RecordsJson)
+    {
+        fprintf(stats->Records, "frame,frame_ns,app_ns,flush_ns,pixels,calls,upload_bytes");
+        for (int i = 0; stats->Perf && i < simPerfCount(stats->Perf); i++)
+            fprintf(stats->Records, ",%s", simPerfName(stats->Perf, i));
+        fprintf(stats->Records, "\n");
+    }
+}
+
+void simStatsDestroy(SimContext *ctx)
+{
+    if (!ctx->Stats)
+        return;
+    if (ctx->Stats->Records)
+        fclose(ctx->Stats->Records);
+    simPerfClose(ctx->Stats->Perf);
+    free(ctx->Stats);
+    ctx->Stats = NULL;
+}
+
+void simStatsFlushBegin(SimContext *ctx)
+{
+    SimStats *stats = ctx->Stats;
+    stats->FlushBegin = simNowNs();
+    if (!stats->Perf)
+        return;
+    uint64_t now[SIM_PERF_MAX];
+    memcpy(now, stats->PerfMark, sizeof(now));
+    simPerfRead(stats->Perf, now);
+    for (int i = 0; i < simPerfCount(stats->Perf); i++)
+    {
+        stats->PerfApp[i] = now[i] - stats->PerfMark[i];
+        stats->PerfTotal[i] += stats->PerfApp[i];
+    }
+}
+
+// Appends the app counters of the frame to a record
+static void writePerf(const SimStats *stats)
+{
+    for (int i = 0; i < simPerfCount(stats->Perf); i++)
+    {
+        if (stats->RecordsJson)
+            fprintf(stats->Records, ", \"%s\": %llu", simPerfName(stats->Perf, i),
+                    (unsigned long long)stats->PerfApp[i]);
+        else
+            fprintf(stats->Records, ",%llu", (unsigned long long)stats->PerfApp[i]);
+    }
+}
+
+void simStatsFlushEnd(SimContext *ctx, uint64_t uploadBytes)
+{
+    SimStats *stats = ctx->Stats;
+    const SimCounters *count = &ctx->Count;
+    uint64_t now = simNowNs();
+    uint64_t frame = now - stats->LastFlushEnd;
+    uint64_t app = stats->FlushBegin - stats->LastFlushEnd;
+    uint64_t flush = now - stats->FlushBegin;
+    stats->LastFlushEnd = now;
+
+    histAdd(&stats->FrameTime, frame);
+    histAdd(&stats->AppTime, app);
+    histAdd(&stats->FlushTime, flush);
+    stats->Total.Pixels += count->Pixels;
+    stats->Total.Calls += count->Calls;
+    stats->TotalUpload += uploadBytes;
+
+    if (stats->Records && stats->RecordsJson)
+    {
+        fprintf(stats->Records,
+                "{\"frame\": %lu, \"frame_ns\": %llu, \"app_ns\": %llu, \"flush_ns\": %llu, "
+                "\"pixels\": %llu, \"calls\": %llu, \"upload_bytes\": %llu",
+                ctx->Frame, (unsigned long long)frame, (unsigned long long)app,
+                (unsigned long long)flush, (unsigned long long)count->Pixels,
+                (unsigned long long)count->Calls, (unsigned long long)uploadBytes);
+        if (stats->Perf)
+            writePerf(stats);
+        fprintf(stats->Records, "}\n");
+    }
+    else if (stats->Records)
+    {
+        fprintf(stats->Records, "%lu,%llu,%llu,%llu,%llu,%llu,%llu", ctx->Frame,
+                (unsigned long long)frame, (unsigned long long)app, (unsigned long long)flush,
+                (unsigned long long)count->Pixels, (unsigned long long)count->Calls,
+                (unsigned long long)uploadBytes);
+        if (stats->Perf)
+            writePerf(stats);
+        fprintf(stats->Records, "\n");
+    }
+    memset(&ctx->Count, 0, sizeof(ctx->Count));
+    // Flush work is not counted against the next frame
+    if (stats->Perf)
+        simPerfRead(stats->Perf, stats->PerfMark);
+}
+
+void simStatsTotals(SimContext *ctx, SimCounters *count, uint64_t *frameNs, uint64_t *appNs)
+{
+    *count = ctx->Stats->Total;
+    *frameNs = ctx->Stats->FrameTime.Sum;
+    *appNs = ctx->Stats->AppTime.Sum;
+}
+
+void simStatsReport(SimContext *ctx)
+{
+    SimStats *stats = ctx->Stats;
+    if (stats->Records)
+    {
+        fclose(stats->Records);
+        stats->Records = NULL;
+    }
+    uint64_t frames = stats->FrameTime.Count;
+    if (!frames || ctx->Quiet)
+        return;
+    char tag[32] = "[SIM]";
+    if (ctx->Id)
+        snprintf(tag, sizeof(tag), "[SIM %d]", ctx->Id);
+    double avg = (double)stats->FrameTime.Sum / frames;
+    fprintf(stderr, "%s %llu frames, %.1f fps\n", tag, (unsigned long long)frames, 1e9 / avg);
+    fprintf(stderr, "%s   per frame: %.0f pixels, %.1f draw calls, %.0f upload bytes\n", tag,
+            (double)stats->Total.Pixels / frames, (double)stats->Total.Calls / frames,
+            (double)stats->TotalUpload / frames);
+    histReport(tag, "frame", &stats->FrameTime);
+    histReport(tag, "app", &stats->AppTime);
+    histReport(tag, "flush", &stats->FlushTime);
+    if (stats->Perf)
+        perfReport(tag, stats, frames);
+}
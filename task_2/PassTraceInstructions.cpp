@@ -4,19 +4,214 @@
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Type.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringMap.h"
+#include <map>
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Regex.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Compiler.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 using namespace llvm;
 
+// Pipeline names:
+//   trace-instruction           instructionLogger/usesLogger call per instruction (log.c)
+//   trace-instruction<counter>  inline increment of a per-module counter per
+//                               instruction, dumped at exit (log_counts.c)
+//   trace-instruction<block>    same counts from one counter per basic block,
+//                               the runtime expands them by a static
+//                               block -> instructions table
+// Both counting modes also emit the def-use edges of the module as a static
+// table, the runtime weights them by the execution count of the def in
+// place of a usesLogger call per use
+//   trace-instruction<binary>   ordered trace of instruction IDs in per-thread
+//                               ring buffers, written by a background thread
+//                               (log_binary.c, decoded by trace_decode)
+//   trace-instruction<sample>   every block decrements a thread-local
+//                               countdown, the runtime records the block when
+//                               it runs out and reports the block mode counts
+//                               scaled by TRACE_SAMPLE_PERIOD (log_counts.c)
+//   trace-instruction<ngram>    traceNgram call with the opcode per
+//                               instruction, the runtime counts opcode
+//                               sequences in place and prints the most
+//                               common ones at exit (log_ngram.c)
+//   trace-instruction<path>     Ball-Larus path profile: a path register
+//                               summed up along the edges of every function,
+//                               the path counted at back edges and returns,
+//                               hottest paths printed at exit (log_counts.c)
+enum class TraceMode { Text, Counter, Block, Binary, Sample, Ngram, Path };
+// Any mode takes a selection of the code to instrument, e.g.
+// trace-instruction<block;filter=draw_.*;profile=counts.txt;hot=1000>
+//   filter=<regex>   only functions whose whole name matches
+//   profile=<path>   [COUNT] report of an earlier counter, block or sample
+//                    run (TRACE_COUNTS), with one of
+//   hot=<n>          only blocks that ran at least n times
+//   cold=<n>         only blocks that ran fewer than n times (cold=1: the
+//                    blocks the profiled run never reached)
+// Path mode takes or leaves whole functions: those with a selected block
+
+struct TraceOptions {
+  TraceMode Mode = TraceMode::Text;
+  std::string Filter;
+  std::string Profile;
+  uint64_t Hot = 0;
+  uint64_t Cold = 0;
+};
+
+static Expected<TraceOptions> parseTraceOptions(StringRef Params) {
+  TraceOptions Options;
+  while (!Params.empty()) {
+    StringRef Param;
+    std::tie(Param, Params) = Params.split(';');
+    if (Param == "text")
+      Options.Mode = TraceMode::Text;
+    else if (Param == "counter")
+      Options.Mode = TraceMode::Counter;
+    else if (Param == "block")
+      Options.Mode = TraceMode::Block;
+    else if (Param == "binary")
+      Options.Mode = TraceMode::Binary;
+    else if (Param == "sample")
+      Options.Mode = TraceMode::Sample;
+    else if (Param == "ngram")
+      Options.Mode = TraceMode::Ngram;
+    else if (Param == "path")
+      Options.Mode = TraceMode::Path;
+    else if (Param.consume_front("filter="))
+      Options.Filter = Param.str();
+    else if (Param.consume_front("profile="))
+      Options.Profile = Param.str();
+    else if (Param.consume_front("hot=")) {
+      if (Param.getAsInteger(10, Options.Hot) || !Options.Hot)
+        return make_error<StringError>("invalid trace-instruction hot count '" + Param + "'",
+                                       inconvertibleErrorCode());
+    } else if (Param.consume_front("cold=")) {
+      if (Param.getAsInteger(10, Options.Cold) || !Options.Cold)
+        return make_error<StringError>("invalid trace-instruction cold count '" + Param + "'",
+                                       inconvertibleErrorCode());
+    } else
+      return make_error<StringError>("invalid trace-instruction parameter '" + Param + "'",
+                                     inconvertibleErrorCode());
+  }
+  std::string RegexError;
+  if (!Options.Filter.empty() && !Regex(Options.Filter).isValid(RegexError))
+    return make_error<StringError>("invalid trace-instruction filter: " + RegexError, inconvertibleErrorCode());
+  if (Options.Hot && Options.Cold)
+    return make_error<StringError>("trace-instruction takes hot= or cold=, not both", inconvertibleErrorCode());
+  if (Options.Profile.empty() != !(Options.Hot || Options.Cold))
+    return make_error<StringError>("trace-instruction needs profile= together with hot= or cold=",
+                                   inconvertibleErrorCode());
+  return Options;
+}
+
+// The blocks a TraceOptions selects. Profile counts are looked up by the
+// stable ID of the first instruction of a block, a block missing from the
+// profile ran 0 times
+class BlockSelection {
+public:
+  BlockSelection(const TraceOptions &Options) : Hot(Options.Hot), Cold(Options.Cold) {
+    if (!Options.Filter.empty())
+      Filter = std::make_unique<Regex>("^(" + Options.Filter + ")$");
+    if (!Options.Profile.empty())
+      loadProfile(Options.Profile);
+  }
+
+  bool contains(const Function &F, uint64_t FirstId) const {
+    if (Filter && !Filter->match(F.getName()))
+      return false;
+    if (!Hot && !Cold)
+      return true;
+    auto It = Counts.find(FirstId);
+    uint64_t Count = It == Counts.end() ? 0 : It->second;
+    return Hot ? Count >= Hot : Count < Cold;
+  }
+
+private:
+  std::unique_ptr<Regex> Filter;
+  uint64_t Hot;
+  uint64_t Cold;
+  DenseMap<uint64_t, uint64_t> Counts;
+
+  // [COUNT] #<id>: <opcode> <count> lines, anything else is skipped
+  void loadProfile(StringRef Path) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFile(Path);
+    if (!Buffer)
+      report_fatal_error("trace-instruction: can't read profile " + Path + ": " + Buffer.getError().message());
+    SmallVector<StringRef, 0> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n');
+    for (StringRef Line : Lines) {
+      StringRef Id, Count;
+      if (!Line.consume_front("[COUNT] #"))
+        continue;
+      std::tie(Id, Count) = Line.split(':');
+      uint64_t IdValue, CountValue;
+      if (!Id.getAsInteger(10, IdValue) && !Count.rsplit(' ').second.trim().getAsInteger(10, CountValue))
+        Counts[IdValue] = CountValue;
+    }
+    if (Counts.empty())
+      errs() << "trace-instruction: no [COUNT] lines in " << Path << "\n";
+  }
+};
+
+// Stable instruction IDs: a hash of the function in the high half (31 bits,
+// so IDs stay positive in log.c) and the position of the instruction among
+// the non-PHI instructions of the function in the low half. They do not
+// depend on pass order or on other functions. Local functions are
+// qualified with the module so equal names in two modules do not clash
+static uint64_t functionIdBase(const Function &F) {
+  uint32_t Hash = 2166136261u;
+  auto Mix = [&Hash](StringRef Str) {
+    for (unsigned char C : Str) {
+      Hash ^= C;
+      Hash *= 16777619u;
+    }
+  };
+  if (F.hasLocalLinkage()) {
+    Mix(F.getParent()->getSourceFileName());
+    Mix("/");
+  }
+  Mix(F.getName());
+  return (uint64_t)(Hash & 0x7FFFFFFF) << 32;
+}
+
 struct TraceInstructionPass : public PassInfoMixin<TraceInstructionPass> {
-  static unsigned InstructionCounter;
+  TraceOptions Options;
 
-  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+  TraceInstructionPass(TraceOptions Options = TraceOptions()) : Options(Options) {}
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+    bool Broken = false;
+    BlockSelection Selection(Options);
+    if (Options.Mode != TraceMode::Text) {
+      instrumentModule(M, Options.Mode, Selection);
+      Broken = verifyModule(M, &errs());
+    } else {
+      for (auto &F : M) {
+        if (F.isDeclaration())
+          continue;
+        instrumentText(F, Selection);
+        if (verifyFunction(F, &errs())) {
+          errs() << "Function " << F.getName() << " is broken!\n";
+          Broken = true;
+        }
+      }
+    }
+    if (Broken)
+      errs() << "Module " << M.getName() << " is broken!\n";
+    return PreservedAnalyses::none();
+  }
+
+  void instrumentText(Function &F, const BlockSelection &Selection) {
     Module *M = F.getParent();
     LLVMContext &Ctx = M->getContext();
 
@@ -33,7 +228,9 @@ struct TraceInstructionPass : public PassInfoMixin<TraceInstructionPass> {
                           {Type::getInt8Ty(Ctx)->getPointerTo(), Type::getInt8Ty(Ctx)->getPointerTo()},
                           false));
 
+    uint64_t InstructionCounter = functionIdBase(F);
     for (auto &BB : F) {
+      bool Selected = Selection.contains(F, InstructionCounter);
       for (auto &I : BB) {
         if (isa<PHINode>(&I))
           continue;
@@ -43,6 +240,8 @@ struct TraceInstructionPass : public PassInfoMixin<TraceInstructionPass> {
         std::string InstName = I.getOpcodeName();
 
         uint64_t InstID = InstructionCounter++;
+        if (!Selected)
+          continue;
 
         Value *InstStrConst = Builder.CreateGlobalStringPtr(InstName);
         Value *InstIDConst = ConstantInt::get(Type::getInt64Ty(Ctx), InstID);
@@ -52,7 +251,7 @@ struct TraceInstructionPass : public PassInfoMixin<TraceInstructionPass> {
         for (auto &Use : I.uses()) {
           User *U = Use.getUser();
           if (Instruction *UserInst = dyn_cast<Instruction>(U)) {
-            
+
             std::string LhsName = I.getOpcodeName();
             std::string RhsName = UserInst->getOpcodeName();
 
@@ -65,30 +264,620 @@ struct TraceInstructionPass : public PassInfoMixin<TraceInstructionPass> {
         }
       }
     }
+  }
+
+  // Private C string constant, as i8*
+  static Constant *createString(Module &M, StringRef Str, const Twine &Name) {
+    Constant *Init = ConstantDataArray::getString(M.getContext(), Str);
+    auto *GV = new GlobalVariable(M, Init->getType(), true, GlobalValue::PrivateLinkage, Init, Name);
+    GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    return ConstantExpr::getPointerCast(GV, Type::getInt8Ty(M.getContext())->getPointerTo());
+  }
+
+  // Private constant integer array, as a pointer to its first element
+  template <typename T>
+  static Constant *createTable(Module &M, ArrayRef<T> Values, const Twine &Name) {
+    auto *PtrTy = IntegerType::get(M.getContext(), sizeof(T) * 8)->getPointerTo();
+    if (Values.empty())
+      return ConstantPointerNull::get(PtrTy);
+    Constant *Init = ConstantDataArray::get(M.getContext(), Values);
+    auto *GV = new GlobalVariable(M, Init->getType(), true, GlobalValue::PrivateLinkage, Init, Name);
+    return ConstantExpr::getPointerCast(GV, PtrTy);
+  }
+
+  // Static allocas have to stay at the top of the entry block
+  static Instruction *skipAllocas(Instruction *I) {
+    while (isa<AllocaInst>(I))
+      I = I->getNextNode();
+    return I;
+  }
+
+  // Loads this thread's counter array of the module from the TLS slot at
+  // function entry, asking the runtime for a fresh one on the first call
+  // in a thread. Returns the array and the instruction the increments of
+  // the entry block have to stay behind
+  static std::pair<Value *, Instruction *> loadThreadCounters(Function &F, GlobalVariable *Slot,
+                                                              FunctionCallee Allocate, Value *Desc) {
+    Type *PtrTy = Slot->getValueType();
+    Instruction *SplitBefore = skipAllocas(&*F.getEntryBlock().getFirstInsertionPt());
+    IRBuilder<> Builder(SplitBefore);
+    LoadInst *Cached = Builder.CreateLoad(PtrTy, Slot);
+    Instruction *Then = SplitBlockAndInsertIfThen(Builder.CreateIsNull(Cached), SplitBefore, false);
+    Builder.SetInsertPoint(Then);
+    Value *Fresh = Builder.CreateCall(Allocate, {Desc});
+    Builder.CreateStore(Fresh, Slot);
+    Builder.SetInsertPoint(SplitBefore);
+    PHINode *Counters = Builder.CreatePHI(PtrTy, 2);
+    Counters->addIncoming(Cached, Cached->getParent());
+    Counters->addIncoming(Fresh, Then->getParent());
+    return {Counters, SplitBefore};
+  }
+
+  // Distinct successors of BB in terminator order
+  static SmallVector<BasicBlock *, 4> uniqueSuccessors(BasicBlock *BB) {
+    SmallVector<BasicBlock *, 4> Succs;
+    for (BasicBlock *Succ : successors(BB))
+      if (!is_contained(Succs, Succ))
+        Succs.push_back(Succ);
+    return Succs;
+  }
+
+  // Edge of the Ball-Larus DAG. To is null for the exit; dummy edges stand
+  // for a back edge: entry -> loop header starts a path, block -> exit
+  // ends one (Back is the header then)
+  struct PathEdge {
+    BasicBlock *To;
+    BasicBlock *Back;
+    bool Dummy;
+    uint64_t Increment;
+  };
+
+  struct PathNumbering {
+    std::vector<BasicBlock *> Blocks;
+    DenseMap<BasicBlock *, uint32_t> Index;
+    // Out-edges per block, increments ascending
+    std::vector<std::vector<PathEdge>> Out;
+    uint64_t PathCount = 0;
+  };
 
-    bool Broken = verifyFunction(F, &errs());
-    if (Broken) {
-      errs() << "Function " << F.getName() << " is broken!\n";
-      return PreservedAnalyses::none();
+  // Ball-Larus numbering: back edges (found by a DFS) are replaced by dummy
+  // edges, then in reverse topological order every edge gets the number of
+  // paths through the edges before it as increment. The increments along
+  // a path from entry to exit sum up to a unique number below PathCount.
+  // Fails when F has more than Limit paths
+  static bool numberPaths(Function &F, PathNumbering &P, uint64_t Limit) {
+    for (auto &BB : F) {
+      P.Index[&BB] = P.Blocks.size();
+      P.Blocks.push_back(&BB);
+    }
+    P.Out.resize(P.Blocks.size());
+
+    struct Frame {
+      BasicBlock *BB;
+      SmallVector<BasicBlock *, 4> Succs;
+      size_t Next;
+    };
+    std::vector<Frame> Stack;
+    std::vector<BasicBlock *> PostOrder;
+    DenseSet<BasicBlock *> Visited, OnStack;
+    DenseSet<std::pair<BasicBlock *, BasicBlock *>> BackEdges;
+    auto Push = [&](BasicBlock *BB) {
+      Visited.insert(BB);
+      OnStack.insert(BB);
+      Stack.push_back({BB, uniqueSuccessors(BB), 0});
+    };
+    Push(&F.getEntryBlock());
+    while (!Stack.empty()) {
+      Frame &Top = Stack.back();
+      if (Top.Next < Top.Succs.size()) {
+        BasicBlock *From = Top.BB, *Succ = Top.Succs[Top.Next++];
+        if (OnStack.count(Succ))
+          BackEdges.insert({From, Succ});
+        else if (!Visited.count(Succ))
+          Push(Succ);
+        continue;
+      }
+      OnStack.erase(Top.BB);
+      PostOrder.push_back(Top.BB);
+      Stack.pop_back();
+    }
+
+    SmallVector<BasicBlock *, 8> Headers;
+    for (BasicBlock *BB : P.Blocks)
+      if (any_of(predecessors(BB), [&](BasicBlock *Pred) { return BackEdges.count({Pred, BB}); }))
+        Headers.push_back(BB);
+
+    std::vector<uint64_t> Paths(P.Blocks.size(), 0);
+    for (BasicBlock *BB : PostOrder) {
+      uint32_t V = P.Index[BB];
+      uint64_t Sum = 0;
+      auto Add = [&](BasicBlock *To, BasicBlock *Back, bool Dummy) {
+        P.Out[V].push_back({To, Back, Dummy, Sum});
+        Sum += To ? Paths[P.Index[To]] : 1;
+      };
+      for (BasicBlock *Succ : uniqueSuccessors(BB))
+        if (!BackEdges.count({BB, Succ}))
+          Add(Succ, nullptr, false);
+      for (BasicBlock *Succ : uniqueSuccessors(BB))
+        if (BackEdges.count({BB, Succ}))
+          Add(nullptr, Succ, true);
+      if (succ_empty(BB))
+        Add(nullptr, nullptr, false);
+      if (BB == &F.getEntryBlock())
+        for (BasicBlock *Header : Headers)
+          Add(Header, nullptr, true);
+      if (Sum > Limit)
+        return false;
+      Paths[V] = Sum;
     }
+    P.PathCount = Paths[0];
+    return true;
+  }
 
-    return PreservedAnalyses::all();
+  // Where code for the edge From -> To goes, splits the edge if critical
+  static Instruction *edgeInsertionPoint(BasicBlock *From, BasicBlock *To) {
+    if (From->getUniqueSuccessor() == To)
+      return From->getTerminator();
+    if (To->getUniquePredecessor() == From)
+      return &*To->getFirstInsertionPt();
+    Instruction *Term = From->getTerminator();
+    unsigned Succ = 0;
+    while (Term->getSuccessor(Succ) != To)
+      Succ++;
+    return SplitCriticalEdge(Term, Succ, CriticalEdgeSplittingOptions().setMergeIdenticalEdges())->getTerminator();
   }
-};
 
-unsigned TraceInstructionPass::InstructionCounter = 0;
+  // Block label for the path report: its name or bbN, with the source
+  // line when there is debug info
+  static std::string blockLabel(BasicBlock &BB, uint32_t Index) {
+    std::string Label = BB.hasName() ? BB.getName().str() : "bb" + std::to_string(Index);
+    for (Instruction &I : BB)
+      if (const DebugLoc &Loc = I.getDebugLoc())
+        if (Loc.getLine())
+          return Label + ":" + std::to_string(Loc.getLine());
+    return Label;
+  }
+
+  // Path mode: numbers the paths of every function and instruments it, the
+  // paths of all functions share one counter array, Base being the first
+  // counter of a function. Functions with exception handling or indirect
+  // branches (edges that cannot be split) or with more than PathLimit
+  // paths are left out. Returns the TracePathFunction table and its size
+  std::pair<Constant *, uint32_t> instrumentPaths(Module &M, StructType *DescTy, StructType *FunctionTy,
+                                                  GlobalVariable *Desc, const DenseSet<Function *> &Selected,
+                                                  uint64_t &CounterCount) {
+    const uint64_t PathLimit = 1 << 16;
+    const uint32_t DummyFlag = 0x80000000;
+    LLVMContext &Ctx = M.getContext();
+    Type *Int32Ty = Type::getInt32Ty(Ctx);
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    Type *Int8PtrTy = Type::getInt8Ty(Ctx)->getPointerTo();
+    Type *Int64PtrTy = Int64Ty->getPointerTo();
+
+    auto *ThreadSlot = new GlobalVariable(M, Int64PtrTy, false, GlobalValue::InternalLinkage,
+                                          ConstantPointerNull::get(cast<PointerType>(Int64PtrTy)),
+                                          "__trace_thread_counters", nullptr,
+                                          GlobalValue::GeneralDynamicTLSModel);
+    FunctionCallee Allocate = M.getOrInsertFunction(
+        "traceCountersThread", FunctionType::get(Int64PtrTy, {DescTy->getPointerTo()}, false));
+
+    std::vector<Constant *> Functions;
+    for (auto &F : M) {
+      if (F.isDeclaration() || !Selected.count(&F))
+        continue;
+      bool Splittable = none_of(F, [](BasicBlock &BB) {
+        return BB.isEHPad() || isa<IndirectBrInst>(BB.getTerminator()) || isa<CallBrInst>(BB.getTerminator());
+      });
+      PathNumbering P;
+      if (!Splittable || !numberPaths(F, P, PathLimit)) {
+        errs() << "trace-instruction<path>: " << F.getName() << " not profiled ("
+               << (Splittable ? "too many paths" : "edges cannot be split") << ")\n";
+        continue;
+      }
+      uint64_t Base = CounterCount;
+      CounterCount += P.PathCount;
+
+      // Tables for the runtime, taken before edges are split
+      std::vector<Constant *> Labels;
+      std::vector<uint32_t> EdgeStart, Edges;
+      for (uint32_t V = 0; V < P.Blocks.size(); V++) {
+        Labels.push_back(createString(M, blockLabel(*P.Blocks[V], V), "__trace_block"));
+        EdgeStart.push_back(Edges.size() / 2);
+        for (const PathEdge &E : P.Out[V]) {
+          uint32_t Target = E.To ? P.Index[E.To] : P.Blocks.size();
+          Edges.push_back(Target | (E.Dummy ? DummyFlag : 0));
+          Edges.push_back(E.Increment);
+        }
+      }
+      EdgeStart.push_back(Edges.size() / 2);
+      auto *LabelsTy = ArrayType::get(Int8PtrTy, Labels.size());
+      auto *LabelsGV = new GlobalVariable(M, LabelsTy, true, GlobalValue::PrivateLinkage,
+                                          ConstantArray::get(LabelsTy, Labels), "__trace_block_names");
+      Functions.push_back(ConstantStruct::get(
+          FunctionTy, {createString(M, F.getName(), "__trace_function_name"), ConstantInt::get(Int64Ty, Base),
+                       ConstantInt::get(Int64Ty, P.PathCount), ConstantInt::get(Int32Ty, P.Blocks.size()),
+                       ConstantExpr::getPointerCast(LabelsGV, Int8PtrTy->getPointerTo()),
+                       createTable<uint32_t>(M, EdgeStart, "__trace_edge_start"),
+                       createTable<uint32_t>(M, Edges, "__trace_edges")}));
+
+      // Path register, zero at entry
+      BasicBlock &Entry = F.getEntryBlock();
+      IRBuilder<> Builder(&*Entry.getFirstInsertionPt());
+      AllocaInst *Path = Builder.CreateAlloca(Int64Ty, nullptr, "__trace_path");
+      Builder.SetInsertPoint(skipAllocas(Path));
+      Builder.CreateStore(ConstantInt::get(Int64Ty, 0), Path);
+
+      // Increments on the edges, resets at the back edges. The counts need
+      // the thread's counters, they are added once those are loaded
+      DenseMap<BasicBlock *, uint64_t> HeaderStart;
+      for (const PathEdge &E : P.Out[0])
+        if (E.Dummy)
+          HeaderStart[E.To] = E.Increment;
+      std::vector<std::pair<Instruction *, uint64_t>> Counts;
+      for (uint32_t V = 0; V < P.Blocks.size(); V++) {
+        BasicBlock *From = P.Blocks[V];
+        for (const PathEdge &E : P.Out[V]) {
+          if (E.To && !E.Dummy && E.Increment) {
+            Builder.SetInsertPoint(edgeInsertionPoint(From, E.To));
+            Value *Sum = Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Path), ConstantInt::get(Int64Ty, E.Increment));
+            Builder.CreateStore(Sum, Path);
+          } else if (E.Back) {
+            Builder.SetInsertPoint(edgeInsertionPoint(From, E.Back));
+            Counts.push_back({Builder.CreateStore(ConstantInt::get(Int64Ty, HeaderStart[E.Back]), Path),
+                              Base + E.Increment});
+          } else if (!E.To) {
+            Counts.push_back({From->getTerminator(), Base + E.Increment});
+          }
+        }
+      }
+      Value *Counters = loadThreadCounters(F, ThreadSlot, Allocate, Desc).first;
+      for (auto &Count : Counts) {
+        Builder.SetInsertPoint(Count.first);
+        Value *Index = Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Path), ConstantInt::get(Int64Ty, Count.second));
+        Value *Slot = Builder.CreateInBoundsGEP(Int64Ty, Counters, Index);
+        Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Slot), ConstantInt::get(Int64Ty, 1)), Slot);
+      }
+    }
+    if (Functions.empty())
+      return {ConstantPointerNull::get(FunctionTy->getPointerTo()), 0};
+    auto *TableTy = ArrayType::get(FunctionTy, Functions.size());
+    auto *Table = new GlobalVariable(M, TableTy, true, GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(TableTy, Functions), "__trace_functions");
+    return {ConstantExpr::getPointerCast(Table, FunctionTy->getPointerTo()), Functions.size()};
+  }
+
+  // Inline contexts and source locations of the instructions, for the
+  // sample profile the counting modes write (TRACE_PROFILE, log_counts.c).
+  // A context is a function, the top-level one or an inlined instance in a
+  // context at a call site; locations are line offsets from the start of
+  // the function and base discriminators, as the sample profile loader
+  // matches them
+  struct ProfileLocations {
+    std::map<std::tuple<uint32_t, uint32_t, uint32_t, std::string>, uint32_t> Index;
+    std::vector<uint32_t> Contexts;
+    std::vector<std::string> Names;
+    std::vector<uint32_t> Locations;
+    bool HasDebugInfo = false;
+  };
+
+  static uint32_t lineOffset(const DILocation *Loc) {
+    return (Loc->getLine() - Loc->getScope()->getSubprogram()->getLine()) & 0xFFFF;
+  }
+
+  static std::string profileName(const DISubprogram *SP) {
+    return (SP->getLinkageName().empty() ? SP->getName() : SP->getLinkageName()).str();
+  }
+
+  // Context (Contexts[3c] is the parent + 1, 0 for a top-level function whose
+  // first instruction is Contexts[3c + 1]) of Name at a call site of Parent
+  static uint32_t profileContext(ProfileLocations &P, uint32_t Parent, uint32_t Offset, uint32_t Discriminator,
+                                 const std::string &Name) {
+    auto Inserted = P.Index.insert({{Parent, Offset, Discriminator, Name}, static_cast<uint32_t>(P.Names.size())});
+    if (Inserted.second) {
+      P.Contexts.insert(P.Contexts.end(), {Parent, Offset, Discriminator});
+      P.Names.push_back(Name);
+    }
+    return Inserted.first->second;
+  }
+
+  // Locations triple of I: context + 1 (0 without a line), offset and
+  // discriminator in that context
+  static void addProfileLocation(ProfileLocations &P, uint32_t Root, Instruction &I) {
+    const DILocation *Loc = I.getDebugLoc();
+    if (!Loc || !Loc->getLine()) {
+      P.Locations.insert(P.Locations.end(), {0, 0, 0});
+      return;
+    }
+    P.HasDebugInfo = true;
+    // Outermost call site first
+    SmallVector<const DILocation *, 4> Chain;
+    for (; Loc; Loc = Loc->getInlinedAt())
+      Chain.push_back(Loc);
+    uint32_t Context = Root;
+    for (size_t K = Chain.size() - 1; K > 0; K--)
+      Context = profileContext(P, Context + 1, lineOffset(Chain[K]), Chain[K]->getBaseDiscriminator(),
+                               profileName(Chain[K - 1]->getScope()->getSubprogram()));
+    P.Locations.insert(P.Locations.end(), {Context + 1, lineOffset(Chain[0]), Chain[0]->getBaseDiscriminator()});
+  }
+
+  // Every non-PHI instruction gets an index from its position in the
+  // module, the descriptor maps it to the stable ID. Counters are
+  // incremented inline, one per instruction, or in block mode one per basic
+  // block: all non-PHI instructions of a block run as often as the block is
+  // entered (short of a call that never returns). Every thread counts into
+  // its own array, the runtime merges them into @__trace_counters at exit.
+  // Sample mode keeps the block sites but only decrements a thread-local
+  // countdown, the traceSample call when it runs out is off the hot path.
+  // Path mode counts paths instead of instructions (instrumentPaths).
+  // Binary mode calls traceEvent with the index instead, ngram mode
+  // traceNgram with the opcode index.
+  //
+  // A TraceModule descriptor (trace_module.h) holds the opcode and the
+  // stable ID of every instruction and, per block, its first instruction
+  // index. Def-use edges go to the descriptor as (def ID, user opcode,
+  // number of uses) triples: a def with N uses by instructions of one
+  // opcode contributes N edges every time it runs. The module constructor
+  // registers the descriptor with the runtime and the destructor lets it
+  // report
+  void instrumentModule(Module &M, TraceMode Mode, const BlockSelection &Selection) {
+    LLVMContext &Ctx = M.getContext();
+    bool PerBlock = Mode == TraceMode::Block || Mode == TraceMode::Sample;
+    Type *Int32Ty = Type::getInt32Ty(Ctx);
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    Type *Int8PtrTy = Type::getInt8Ty(Ctx)->getPointerTo();
+
+    std::vector<Instruction *> Sites;
+    std::vector<uint32_t> Opcodes;
+    std::vector<uint64_t> Ids;
+    std::vector<uint32_t> BlockStart;
+    std::vector<uint32_t> Uses;
+    StringMap<uint32_t> OpcodeIndex;
+    // Only named here, their strings are created once something is selected
+    std::vector<StringRef> OpcodeNames;
+    auto opcodeOf = [&](Instruction &I) {
+      auto Inserted = OpcodeIndex.insert({I.getOpcodeName(), OpcodeNames.size()});
+      if (Inserted.second)
+        OpcodeNames.push_back(I.getOpcodeName());
+      return Inserted.first->second;
+    };
+    // With debug info the counting modes also get the inline context and
+    // line of every instruction, so their counts can be written as a
+    // sample profile
+    ProfileLocations Profile;
+    // Unselected code keeps its IDs but gets a null site
+    DenseSet<Function *> Selected;
+    for (auto &F : M) {
+      uint64_t NextId = functionIdBase(F);
+      uint32_t Root = F.isDeclaration() ? 0 : profileContext(Profile, 0, Opcodes.size(), 0, F.getName().str());
+      for (auto &BB : F) {
+        bool Chosen = Selection.contains(F, NextId);
+        if (Chosen)
+          Selected.insert(&F);
+        BlockStart.push_back(Opcodes.size());
+        if (PerBlock)
+          Sites.push_back(Chosen ? &*BB.getFirstInsertionPt() : nullptr);
+        for (auto &I : BB) {
+          if (isa<PHINode>(&I))
+            continue;
+          uint32_t ID = Opcodes.size();
+          Ids.push_back(NextId++);
+          Opcodes.push_back(opcodeOf(I));
+          addProfileLocation(Profile, Root, I);
+          if (!PerBlock)
+            Sites.push_back(Chosen ? &I : nullptr);
+          std::map<uint32_t, uint32_t> UserOpcodes;
+          for (User *U : I.users())
+            if (auto *UserInst = dyn_cast<Instruction>(U))
+              UserOpcodes[opcodeOf(*UserInst)]++;
+          for (auto &Edge : UserOpcodes)
+            Uses.insert(Uses.end(), {ID, Edge.first, Edge.second});
+        }
+      }
+    }
+    if (Selected.empty())
+      return;
+    BlockStart.push_back(Opcodes.size());
+
+    // struct TracePathFunction and struct TraceModule in trace_module.h
+    auto *FunctionTy = StructType::create(Ctx,
+                                          {Int8PtrTy, Int64Ty, Int64Ty, Int32Ty, Int8PtrTy->getPointerTo(),
+                                           Int32Ty->getPointerTo(), Int32Ty->getPointerTo()},
+                                          "struct.TracePathFunction");
+    auto *DescTy = StructType::create(Ctx,
+                                      {Int8PtrTy, Int64Ty, Int64Ty->getPointerTo(), Int64Ty,
+                                       Int32Ty->getPointerTo(), Int32Ty->getPointerTo(),
+                                       Int8PtrTy->getPointerTo(), Int32Ty, Int32Ty->getPointerTo(),
+                                       Int64Ty, Int64Ty, Int64Ty->getPointerTo(), Int8PtrTy,
+                                       FunctionTy->getPointerTo(), Int32Ty, Int32Ty->getPointerTo(),
+                                       Int8PtrTy->getPointerTo(), Int32Ty, Int32Ty->getPointerTo()},
+                                      "struct.TraceModule");
+    // Written by the runtime, not constant
+    auto *Desc = new GlobalVariable(M, DescTy, false, GlobalValue::InternalLinkage, nullptr, "__trace_module");
+
+    Constant *Counters = ConstantPointerNull::get(Int64Ty->getPointerTo());
+    uint64_t CounterCount = 0;
+    std::pair<Constant *, uint32_t> Functions = {ConstantPointerNull::get(FunctionTy->getPointerTo()), 0};
+    if (Mode == TraceMode::Path) {
+      Functions = instrumentPaths(M, DescTy, FunctionTy, Desc, Selected, CounterCount);
+      auto *CountersTy = ArrayType::get(Int64Ty, CounterCount);
+      auto *CountersGV = new GlobalVariable(M, CountersTy, false, GlobalValue::InternalLinkage,
+                                            ConstantAggregateZero::get(CountersTy), "__trace_counters");
+      Counters = ConstantExpr::getPointerCast(CountersGV, Int64Ty->getPointerTo());
+    } else if (Mode == TraceMode::Binary) {
+      FunctionCallee TraceEvent = M.getOrInsertFunction(
+          "traceEvent", FunctionType::get(Type::getVoidTy(Ctx), {DescTy->getPointerTo(), Int32Ty}, false));
+      for (size_t ID = 0; ID < Sites.size(); ID++) {
+        Instruction *I = Sites[ID];
+        if (!I)
+          continue;
+        IRBuilder<> Builder(I->isEHPad() ? I->getNextNode() : I);
+        Builder.CreateCall(TraceEvent, {Desc, ConstantInt::get(Int32Ty, ID)});
+      }
+    } else if (Mode == TraceMode::Ngram) {
+      FunctionCallee TraceNgram = M.getOrInsertFunction(
+          "traceNgram", FunctionType::get(Type::getVoidTy(Ctx), {DescTy->getPointerTo(), Int32Ty}, false));
+      for (size_t ID = 0; ID < Sites.size(); ID++) {
+        Instruction *I = Sites[ID];
+        if (!I)
+          continue;
+        IRBuilder<> Builder(I->isEHPad() ? I->getNextNode() : I);
+        Builder.CreateCall(TraceNgram, {Desc, ConstantInt::get(Int32Ty, Opcodes[ID])});
+      }
+    } else if (Mode == TraceMode::Sample) {
+      // Shared, the runtime adds samples atomically
+      auto *CountersTy = ArrayType::get(Int64Ty, Sites.size());
+      auto *CountersGV = new GlobalVariable(M, CountersTy, false, GlobalValue::InternalLinkage,
+                                            ConstantAggregateZero::get(CountersTy), "__trace_counters");
+      // Zero at thread start, so the first block of a thread asks the
+      // runtime for a period
+      auto *Countdown = new GlobalVariable(M, Int64Ty, false, GlobalValue::InternalLinkage,
+                                           ConstantInt::get(Int64Ty, 0), "__trace_sample_countdown",
+                                           nullptr, GlobalValue::GeneralDynamicTLSModel);
+      FunctionCallee TraceSample = M.getOrInsertFunction(
+          "traceSample", FunctionType::get(Int64Ty, {DescTy->getPointerTo(), Int32Ty}, false));
+      MDNode *Unlikely = MDBuilder(Ctx).createBranchWeights(1, 1 << 20);
+      for (size_t ID = 0; ID < Sites.size(); ID++) {
+        Instruction *I = Sites[ID];
+        if (!I)
+          continue;
+        if (I->getParent()->isEntryBlock())
+          I = skipAllocas(I);
+        IRBuilder<> Builder(I);
+        Value *Left = Builder.CreateSub(Builder.CreateLoad(Int64Ty, Countdown), ConstantInt::get(Int64Ty, 1));
+        Builder.CreateStore(Left, Countdown);
+        Instruction *Then = SplitBlockAndInsertIfThen(
+            Builder.CreateICmpSLE(Left, ConstantInt::get(Int64Ty, 0)), I, false, Unlikely);
+        Builder.SetInsertPoint(Then);
+        Builder.CreateStore(Builder.CreateCall(TraceSample, {Desc, ConstantInt::get(Int32Ty, ID)}), Countdown);
+      }
+      Counters = ConstantExpr::getPointerCast(CountersGV, Int64Ty->getPointerTo());
+      CounterCount = Sites.size();
+    } else {
+      auto *CountersTy = ArrayType::get(Int64Ty, Sites.size());
+      auto *CountersGV = new GlobalVariable(M, CountersTy, false, GlobalValue::InternalLinkage,
+                                            ConstantAggregateZero::get(CountersTy), "__trace_counters");
+      Type *Int64PtrTy = Int64Ty->getPointerTo();
+      auto *ThreadSlot = new GlobalVariable(M, Int64PtrTy, false, GlobalValue::InternalLinkage,
+                                            ConstantPointerNull::get(cast<PointerType>(Int64PtrTy)),
+                                            "__trace_thread_counters", nullptr,
+                                            GlobalValue::GeneralDynamicTLSModel);
+      FunctionCallee Allocate = M.getOrInsertFunction(
+          "traceCountersThread", FunctionType::get(Int64PtrTy, {DescTy->getPointerTo()}, false));
+      Function *Current = nullptr;
+      std::pair<Value *, Instruction *> Thread;
+      for (size_t ID = 0; ID < Sites.size(); ID++) {
+        Instruction *I = Sites[ID];
+        if (!I)
+          continue;
+        if (I->getFunction() != Current) {
+          Current = I->getFunction();
+          Thread = loadThreadCounters(*Current, ThreadSlot, Allocate, Desc);
+        }
+        // Nothing can go in front of a landing pad, its successor runs as
+        // often. Entry block allocas run once like the rest of the block
+        if (I->isEHPad())
+          I = I->getNextNode();
+        else if (isa<AllocaInst>(I) && I->getParent() == &Current->getEntryBlock())
+          I = Thread.second;
+        IRBuilder<> Builder(I);
+        Value *Slot = Builder.CreateConstInBoundsGEP1_64(Int64Ty, Thread.first, ID);
+        Value *Count = Builder.CreateLoad(Int64Ty, Slot);
+        Builder.CreateStore(Builder.CreateAdd(Count, ConstantInt::get(Int64Ty, 1)), Slot);
+      }
+      Counters = ConstantExpr::getPointerCast(CountersGV, Int64Ty->getPointerTo());
+      CounterCount = Sites.size();
+    }
+
+    // Sample profile tables, only worth it with debug info
+    bool Counting = Mode == TraceMode::Counter || Mode == TraceMode::Block || Mode == TraceMode::Sample;
+    Constant *ContextNames = ConstantPointerNull::get(Int8PtrTy->getPointerTo());
+    if (!Counting || !Profile.HasDebugInfo) {
+      Profile.Contexts.clear();
+      Profile.Locations.clear();
+      Profile.Names.clear();
+    } else {
+      std::vector<Constant *> Names;
+      for (const std::string &Name : Profile.Names)
+        Names.push_back(createString(M, Name, "__trace_context"));
+      auto *ContextNamesTy = ArrayType::get(Int8PtrTy, Names.size());
+      auto *ContextNamesGV = new GlobalVariable(M, ContextNamesTy, true, GlobalValue::PrivateLinkage,
+                                                ConstantArray::get(ContextNamesTy, Names), "__trace_context_names");
+      ContextNames = ConstantExpr::getPointerCast(ContextNamesGV, Int8PtrTy->getPointerTo());
+    }
+
+    std::vector<Constant *> OpcodeStrings;
+    for (StringRef Name : OpcodeNames)
+      OpcodeStrings.push_back(createString(M, Name, "__trace_opcode"));
+    auto *NamesTy = ArrayType::get(Int8PtrTy, OpcodeStrings.size());
+    auto *NamesGV = new GlobalVariable(M, NamesTy, true, GlobalValue::PrivateLinkage,
+                                       ConstantArray::get(NamesTy, OpcodeStrings), "__trace_opcode_names");
+
+    Desc->setInitializer(ConstantStruct::get(
+        DescTy, {createString(M, M.getSourceFileName(), "__trace_module_name"),
+                 ConstantInt::get(Int64Ty, Opcodes.size()),
+                 Counters,
+                 ConstantInt::get(Int64Ty, CounterCount),
+                 PerBlock ? createTable<uint32_t>(M, BlockStart, "__trace_block_start")
+                          : createTable<uint32_t>(M, {}, ""),
+                 createTable<uint32_t>(M, Opcodes, "__trace_opcodes"),
+                 ConstantExpr::getPointerCast(NamesGV, Int8PtrTy->getPointerTo()),
+                 ConstantInt::get(Int32Ty, OpcodeNames.size()),
+                 createTable<uint32_t>(M, Uses, "__trace_uses"),
+                 ConstantInt::get(Int64Ty, Uses.size() / 3),
+                 ConstantInt::get(Int64Ty, 0),
+                 createTable<uint64_t>(M, Ids, "__trace_ids"),
+                 ConstantPointerNull::get(cast<PointerType>(Int8PtrTy)),
+                 Functions.first,
+                 ConstantInt::get(Int32Ty, Functions.second),
+                 createTable<uint32_t>(M, Profile.Contexts, "__trace_contexts"),
+                 ContextNames,
+                 ConstantInt::get(Int32Ty, Profile.Names.size()),
+                 createTable<uint32_t>(M, Profile.Locations, "__trace_locations")}));
+
+    StringRef Register = "traceCountersRegister", Close = "traceCountersDump";
+    if (Mode == TraceMode::Binary)
+      Register = "traceBinaryRegister", Close = "traceBinaryClose";
+    else if (Mode == TraceMode::Sample)
+      Register = "traceSampleRegister", Close = "traceSampleDump";
+    else if (Mode == TraceMode::Ngram)
+      Register = "traceNgramRegister", Close = "traceNgramDump";
+    else if (Mode == TraceMode::Path)
+      Close = "tracePathsDump";
+    appendToGlobalCtors(M, createRuntimeCall(M, "__trace_module_ctor", Register, Desc), 0);
+    appendToGlobalDtors(M, createRuntimeCall(M, "__trace_module_dtor", Close, Desc), 0);
+  }
+
+  // Internal void() function calling Runtime(Desc)
+  static Function *createRuntimeCall(Module &M, StringRef Name, StringRef Runtime, GlobalVariable *Desc) {
+    LLVMContext &Ctx = M.getContext();
+    FunctionCallee Callee = M.getOrInsertFunction(
+        Runtime, FunctionType::get(Type::getVoidTy(Ctx), {Desc->getType()}, false));
+    Function *F = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                                   GlobalValue::InternalLinkage, Name, M);
+    IRBuilder<> Builder(BasicBlock::Create(Ctx, "entry", F));
+    Builder.CreateCall(Callee, {Desc});
+    Builder.CreateRetVoid();
+    return F;
+  }
+};
 
 extern "C" PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK llvmGetPassPluginInfo() {
   return {LLVM_PLUGIN_API_VERSION, "TraceInstructionPass", LLVM_VERSION_STRING,
           [](PassBuilder &PB) {
             PB.registerPipelineParsingCallback(
-                [](StringRef Name, FunctionPassManager &FPM,
+                [](StringRef Name, ModulePassManager &MPM,
                    ArrayRef<PassBuilder::PipelineElement>) {
-                  if (Name == "trace-instruction") {
-                    FPM.addPass(TraceInstructionPass());
-                    return true;
+                  if (!Name.consume_front("trace-instruction"))
+                    return false;
+                  if (!Name.empty() && !(Name.consume_front("<") && Name.consume_back(">")))
+                    return false;
+                  Expected<TraceOptions> Options = parseTraceOptions(Name);
+                  if (!Options) {
+                    errs() << toString(Options.takeError()) << "\n";
+                    return false;
                   }
-                  return false;
+                  MPM.addPass(TraceInstructionPass(*Options));
+                  return true;
                 });
           }};
-}
\ No newline at end of file
+}
@@ -1,4 +1,5 @@
 import re
+import json
 import argparse
 from collections import Counter, defaultdict
 import matplotlib.pyplot as plt
@@ -34,6 +35,18 @@ def find_repeated_sequences(instruction_names, max_sequence_length=5):
 
     return sequence_counts, total_instructions
 
+def load_analysis(filename):
+    # JSON written by trace_analyze -o, only the most common sequences
+    with open(filename, 'r') as file:
+        data = json.load(file)
+
+    sequence_counts = defaultdict(Counter)
+    for length, sequences in enumerate(data["sequences"], 1):
+        for entry in sequences:
+            sequence_counts[length][tuple(entry["sequence"])] = entry["frequency"]
+
+    return Counter(data["counts"]), sequence_counts, data["total"]
+
 def plot_single_sequence(ax, sequence_counts, length, total_instructions, max_bars=15):
     ax.clear()
     sequences, frequencies = zip(*sequence_counts[length].most_common(max_bars))
@@ -82,8 +95,7 @@ def interactive_plot(sequence_counts, total_instructions):
     plt.subplots_adjust(bottom=0.2)
     plt.show()
 
-def print_instruction_counts(instruction_names):
-    instruction_counter = Counter(instruction_names)
+def print_instruction_counts(instruction_counter):
     print("\nInstruction Counts:")
     print("===================")
     for instruction, count in instruction_counter.most_common():
@@ -92,11 +104,16 @@ def print_instruction_counts(instruction_names):
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(description="Analyze instruction sequences from a file.")
     parser.add_argument("filename", type=str, help="The name of the file containing instruction data")
+    parser.add_argument("--json", action="store_true", help="The file is the output of trace_analyze -o")
     args = parser.parse_args()
 
-    instruction_names = extract_instruction_names(args.filename)
-    sequence_counts, total_instructions = find_repeated_sequences(instruction_names)
+    if args.json:
+        instruction_counter, sequence_counts, total_instructions = load_analysis(args.filename)
+    else:
+        instruction_names = extract_instruction_names(args.filename)
+        sequence_counts, total_instructions = find_repeated_sequences(instruction_names)
+        instruction_counter = Counter(instruction_names)
 
-    print_instruction_counts(instruction_names)
+    print_instruction_counts(instruction_counter)
 
     interactive_plot(sequence_counts, total_instructions)
\ No newline at end of file
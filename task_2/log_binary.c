@@ -0,0 +1,190 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace_module.h"
+#include "trace_binary.h"
+
+// Runtime of trace-instruction<binary>. traceEvent appends the instruction
+// ID to a ring buffer of the calling thread, a background thread drains
+// all rings into the trace file with large sequential writes
+//   TRACE_FILE=path     output file (default trace.bin)
+//   TRACE_TIMESTAMPS=1  store a timestamp with every event
+
+#define RING_BITS 20
+#define RING_SIZE (1u << RING_BITS)
+#define RING_MASK (RING_SIZE - 1)
+// Writer sleep when the rings were empty
+#define IDLE_NS 1000000
+
+typedef struct Ring {
+    // Producer and writer positions on separate cache lines
+    _Alignas(64) _Atomic uint64_t Head;
+    _Alignas(64) _Atomic uint64_t Tail;
+    uint32_t Thread;
+    struct Ring *Next;
+    uint64_t *Times;
+    uint32_t Ids[RING_SIZE];
+} Ring;
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *Out = NULL;
+static Ring *Rings = NULL;
+static uint32_t RingCount = 0;
+static int Timestamps = 0;
+static uint64_t NextBase = 0;
+static int OpenModules = 0;
+static uint64_t Written = 0;
+static pthread_t Writer;
+static atomic_int Stop;
+static atomic_int Closed;
+static _Thread_local Ring *CurrentRing = NULL;
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void writeChunk(uint32_t type, uint32_t size) {
+    fwrite(&type, sizeof(type), 1, Out);
+    fwrite(&size, sizeof(size), 1, Out);
+}
+
+// Writes what the producer has published so far, Lock held
+static uint64_t drain(Ring *r) {
+    uint64_t head = atomic_load_explicit(&r->Head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&r->Tail, memory_order_relaxed);
+    uint64_t total = head - tail;
+    while (tail != head) {
+        uint32_t start = tail & RING_MASK;
+        uint32_t n = head - tail < RING_SIZE - start ? head - tail : RING_SIZE - start;
+        uint32_t size = 8 + n * (sizeof(uint32_t) + (r->Times ? sizeof(uint64_t) : 0));
+        writeChunk(TRACE_CHUNK_EVENTS, size);
+        fwrite(&r->Thread, sizeof(uint32_t), 1, Out);
+        fwrite(&n, sizeof(uint32_t), 1, Out);
+        fwrite(r->Ids + start, sizeof(uint32_t), n, Out);
+        if (r->Times)
+            fwrite(r->Times + start, sizeof(uint64_t), n, Out);
+        tail += n;
+        atomic_store_explicit(&r->Tail, tail, memory_order_release);
+    }
+    Written += total;
+    return total;
+}
+
+static void *writerMain(void *arg) {
+    (void)arg;
+    while (!atomic_load(&Stop)) {
+        uint64_t drained = 0;
+        pthread_mutex_lock(&Lock);
+        for (Ring *r = Rings; r; r = r->Next)
+            drained += drain(r);
+        pthread_mutex_unlock(&Lock);
+        if (!drained)
+            nanosleep(&(struct timespec){0, IDLE_NS}, NULL);
+    }
+    return NULL;
+}
+
+static Ring *ringCreate(void) {
+    // The header already promised timestamps, so a ring either gets its
+    // timestamp array with it or is not created at all
+    size_t times = Timestamps ? RING_SIZE * sizeof(uint64_t) : 0;
+    Ring *r = aligned_alloc(64, sizeof(Ring) + times);
+    if (!r) {
+        fprintf(stderr, "[TRACE] Can't allocate trace ring\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(r, 0, sizeof(Ring));
+    if (Timestamps)
+        r->Times = (uint64_t *)(r + 1);
+    pthread_mutex_lock(&Lock);
+    r->Thread = RingCount++;
+    r->Next = Rings;
+    Rings = r;
+    pthread_mutex_unlock(&Lock);
+    CurrentRing = r;
+    return r;
+}
+
+void traceEvent(TraceModule *module, uint32_t id) {
+    Ring *r = CurrentRing ? CurrentRing : ringCreate();
+    uint64_t head = atomic_load_explicit(&r->Head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&r->Tail, memory_order_acquire) >= RING_SIZE) {
+        // Nobody drains after the trace is closed, drop the event
+        if (atomic_load_explicit(&Closed, memory_order_relaxed))
+            return;
+        sched_yield();
+    }
+    r->Ids[head & RING_MASK] = (uint32_t)(module->Base + id);
+    if (r->Times)
+        r->Times[head & RING_MASK] = nowNs();
+    atomic_store_explicit(&r->Head, head + 1, memory_order_release);
+}
+
+static void writeModule(const TraceModule *module) {
+    uint32_t size = 2 * sizeof(uint64_t) + sizeof(uint32_t) + strlen(module->Name) + 1 +
+                    module->Count * (sizeof(uint32_t) + sizeof(uint64_t));
+    for (uint32_t i = 0; i < module->OpcodeCount; i++)
+        size += strlen(module->OpcodeNames[i]) + 1;
+    writeChunk(TRACE_CHUNK_MODULE, size);
+    fwrite(&module->Base, sizeof(uint64_t), 1, Out);
+    fwrite(&module->Count, sizeof(uint64_t), 1, Out);
+    fwrite(&module->OpcodeCount, sizeof(uint32_t), 1, Out);
+    fwrite(module->Name, strlen(module->Name) + 1, 1, Out);
+    for (uint32_t i = 0; i < module->OpcodeCount; i++)
+        fwrite(module->OpcodeNames[i], strlen(module->OpcodeNames[i]) + 1, 1, Out);
+    fwrite(module->Opcodes, sizeof(uint32_t), module->Count, Out);
+    fwrite(module->Ids, sizeof(uint64_t), module->Count, Out);
+}
+
+void traceBinaryRegister(TraceModule *module) {
+    pthread_mutex_lock(&Lock);
+    if (!Out) {
+        const char *path = getenv("TRACE_FILE");
+        if (!path)
+            path = "trace.bin";
+        Out = fopen(path, "wb");
+        if (!Out) {
+            fprintf(stderr, "[TRACE] Can't open %s for writing\n", path);
+            exit(EXIT_FAILURE);
+        }
+        setvbuf(Out, NULL, _IOFBF, 1 << 20);
+        const char *timestamps = getenv("TRACE_TIMESTAMPS");
+        Timestamps = timestamps && atoi(timestamps);
+        uint32_t header[2] = {TRACE_BINARY_VERSION, Timestamps ? TRACE_FLAG_TIMESTAMPS : 0};
+        fwrite(TRACE_BINARY_MAGIC, 4, 1, Out);
+        fwrite(header, sizeof(header), 1, Out);
+        pthread_create(&Writer, NULL, writerMain, NULL);
+    }
+    module->Base = NextBase;
+    NextBase += module->Count;
+    OpenModules++;
+    writeModule(module);
+    pthread_mutex_unlock(&Lock);
+}
+
+// The last module closing stops the writer and flushes all rings
+void traceBinaryClose(TraceModule *module) {
+    (void)module;
+    pthread_mutex_lock(&Lock);
+    int last = --OpenModules == 0;
+    pthread_mutex_unlock(&Lock);
+    if (!last)
+        return;
+    atomic_store(&Stop, 1);
+    pthread_join(Writer, NULL);
+    pthread_mutex_lock(&Lock);
+    for (Ring *r = Rings; r; r = r->Next)
+        drain(r);
+    atomic_store(&Closed, 1);
+    fclose(Out);
+    Out = NULL;
+    fprintf(stderr, "[TRACE] %lu events from %u threads\n", (unsigned long)Written, RingCount);
+    pthread_mutex_unlock(&Lock);
+}
@@ -0,0 +1,421 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "trace_module.h"
+
+#define TRACE_SAMPLE_DEFAULT 1000
+#define TRACE_PATHS_TOP 20
+
+// Runtime of trace-instruction<counter> and <block>. The pass fills a
+// TraceModule per instrumented module, its constructor registers it here
+// and its destructor prints the counts. Output goes to stdout, or to the
+// file named by TRACE_COUNTS
+//
+// Threads never share counters: the first instrumented function a thread
+// enters asks traceCountersThread for an array of its own and keeps it in
+// a thread-local slot of the module. Arrays are never freed, so counts of
+// threads that exited before the dump are kept
+//
+// With TRACE_PROFILE=path the counts are also written as a sample profile
+// (text format, one section per top-level function, inlined code nested
+// at its call sites) for clang -fprofile-sample-use. The pass records
+// lines only when the app was built with debug info
+//
+// trace-instruction<sample> shares the report: the pass counts down a
+// thread-local variable per block entry and calls traceSample when it runs
+// out, the sampled block counts are scaled by the period
+//   TRACE_SAMPLE_PERIOD=n   mean block entries between samples (default 1000)
+//
+// trace-instruction<path> counts Ball-Larus paths in the same per-thread
+// arrays, tracePathsDump decodes the hottest ones into blocks
+//   TRACE_PATHS_TOP=k       paths listed (default 20, 0 for all)
+
+typedef struct ThreadCounters {
+    struct ThreadCounters *Next;
+    uint64_t Counts[];
+} ThreadCounters;
+
+static FILE *Output = NULL;
+static FILE *Profile = NULL;
+static pthread_mutex_t ThreadsLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t SamplePeriod = TRACE_SAMPLE_DEFAULT;
+static uint64_t SampleThreads = 0;
+static _Thread_local uint64_t SampleRng = 0;
+
+uint64_t *traceCountersThread(TraceModule *module) {
+    ThreadCounters *thread = calloc(1, sizeof(ThreadCounters) + module->CounterCount * sizeof(uint64_t));
+    if (!thread) {
+        fprintf(stderr, "[TRACE] Out of memory for the counters of %s\n", module->Name);
+        abort();
+    }
+    pthread_mutex_lock(&ThreadsLock);
+    thread->Next = module->Runtime;
+    module->Runtime = thread;
+    pthread_mutex_unlock(&ThreadsLock);
+    return thread->Counts;
+}
+
+// Report buffers are optional: without memory that part of the report is
+// skipped, the counts already collected are not worth an abort
+static void *allocate(size_t count, size_t size, const char *what) {
+    void *p = calloc(count ? count : 1, size);
+    if (!p)
+        fprintf(stderr, "[TRACE] Out of memory for %s, skipping them\n", what);
+    return p;
+}
+
+// Sums the thread arrays into module->Counters, returns the thread count
+static unsigned mergeThreads(TraceModule *module) {
+    unsigned threads = 0;
+    pthread_mutex_lock(&ThreadsLock);
+    for (ThreadCounters *t = module->Runtime; t; t = t->Next, threads++)
+        for (uint64_t c = 0; c < module->CounterCount; c++)
+            module->Counters[c] += t->Counts[c];
+    pthread_mutex_unlock(&ThreadsLock);
+    return threads;
+}
+
+void traceCountersRegister(TraceModule *module) {
+    (void)module;
+    if (Output)
+        return;
+    const char *path = getenv("TRACE_COUNTS");
+    Output = path ? fopen(path, "w") : NULL;
+    if (path && !Output)
+        fprintf(stderr, "[TRACE] Can't open %s for writing\n", path);
+    if (!Output)
+        Output = stdout;
+}
+
+typedef struct OpcodeTotal {
+    const char *Name;
+    uint64_t Count;
+} OpcodeTotal;
+
+static int byCountDesc(const void *a, const void *b) {
+    uint64_t x = ((const OpcodeTotal *)a)->Count, y = ((const OpcodeTotal *)b)->Count;
+    return (x < y) - (x > y);
+}
+
+// Executions of every instruction, expanded from the block counters
+static uint64_t *instructionCounts(const TraceModule *module, uint64_t scale) {
+    uint64_t *counts = allocate(module->Count, sizeof(uint64_t), "the instruction counts");
+    if (!counts)
+        return NULL;
+    for (uint64_t c = 0; c < module->CounterCount; c++) {
+        uint64_t first = module->BlockStart ? module->BlockStart[c] : c;
+        uint64_t last = module->BlockStart ? module->BlockStart[c + 1] : c + 1;
+        for (uint64_t id = first; id < last; id++)
+            counts[id] = module->Counters[c] * scale;
+    }
+    return counts;
+}
+
+static void printTotals(OpcodeTotal *totals, uint64_t count) {
+    qsort(totals, count, sizeof(OpcodeTotal), byCountDesc);
+    for (uint64_t i = 0; i < count && totals[i].Count; i++)
+        fprintf(Output, "%s: %lu\n", totals[i].Name, (unsigned long)totals[i].Count);
+}
+
+// Def-use pairs of opcodes, every static edge weighted by how often its
+// def ran. Same totals as counting the usesLogger output of text mode
+static void dumpUses(const TraceModule *module, const uint64_t *counts) {
+    uint32_t n = module->OpcodeCount;
+    OpcodeTotal *pairs = allocate((size_t)n * n, sizeof(OpcodeTotal), "the use counts");
+    char *names = pairs ? allocate((size_t)n * n, 64, "the use counts") : NULL;
+    if (!names) {
+        free(pairs);
+        return;
+    }
+    for (uint64_t e = 0; e < module->UseCount; e++) {
+        const uint32_t *edge = module->Uses + 3 * e;
+        uint32_t def = module->Opcodes[edge[0]];
+        pairs[def * n + edge[1]].Count += counts[edge[0]] * edge[2];
+    }
+    for (uint32_t i = 0; i < n * n; i++) {
+        char *name = names + (size_t)i * 64;
+        snprintf(name, 64, "%s <- %s", module->OpcodeNames[i / n], module->OpcodeNames[i % n]);
+        pairs[i].Name = name;
+    }
+    fprintf(Output, "\nUse Counts (%s):\n", module->Name);
+    fprintf(Output, "===================\n");
+    printTotals(pairs, (uint64_t)n * n);
+    free(names);
+    free(pairs);
+}
+
+typedef struct LineCount {
+    uint32_t Context;
+    uint32_t Offset;
+    uint32_t Discriminator;
+    uint64_t Count;
+} LineCount;
+
+static int byLine(const void *a, const void *b) {
+    const LineCount *x = a, *y = b;
+    if (x->Context != y->Context)
+        return x->Context < y->Context ? -1 : 1;
+    if (x->Offset != y->Offset)
+        return x->Offset < y->Offset ? -1 : 1;
+    return (x->Discriminator > y->Discriminator) - (x->Discriminator < y->Discriminator);
+}
+
+static void printLocation(uint32_t offset, uint32_t discriminator, int depth) {
+    fprintf(Profile, "%*s%u", depth, "", offset);
+    if (discriminator)
+        fprintf(Profile, ".%u", discriminator);
+    fprintf(Profile, ": ");
+}
+
+// Lines of context c, then its inlined callees at their call sites
+static void writeContext(const TraceModule *module, const LineCount *lines, uint64_t n, const uint64_t *totals,
+                         uint32_t c, int depth) {
+    for (uint64_t i = 0; i < n; i++) {
+        if (lines[i].Context != c)
+            continue;
+        printLocation(lines[i].Offset, lines[i].Discriminator, depth);
+        fprintf(Profile, "%lu\n", (unsigned long)lines[i].Count);
+    }
+    for (uint32_t d = c + 1; d < module->ContextCount; d++) {
+        const uint32_t *context = module->Contexts + 3 * d;
+        if (context[0] != c + 1 || !totals[d])
+            continue;
+        printLocation(context[1], context[2], depth);
+        fprintf(Profile, "%s:%lu\n", module->ContextNames[d], (unsigned long)totals[d]);
+        writeContext(module, lines, n, totals, d, depth + 1);
+    }
+}
+
+// A line counts as often as its most executed instruction, the way the
+// sample profile loader weighs blocks
+static void writeProfile(const TraceModule *module, const uint64_t *counts) {
+    const char *path = getenv("TRACE_PROFILE");
+    if (!path)
+        return;
+    if (!module->Locations) {
+        fprintf(stderr, "[TRACE] %s has no debug info, no sample profile (build it with -g)\n", module->Name);
+        return;
+    }
+    if (!Profile && !(Profile = fopen(path, "w"))) {
+        fprintf(stderr, "[TRACE] Can't open %s for writing\n", path);
+        return;
+    }
+    LineCount *lines = allocate(module->Count, sizeof(LineCount), "the sample profile");
+    if (!lines)
+        return;
+    uint64_t n = 0;
+    for (uint64_t id = 0; id < module->Count; id++) {
+        const uint32_t *location = module->Locations + 3 * id;
+        if (location[0])
+            lines[n++] = (LineCount){location[0] - 1, location[1], location[2], counts[id]};
+    }
+    qsort(lines, n, sizeof(LineCount), byLine);
+    uint64_t merged = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        if (merged && !byLine(&lines[merged - 1], &lines[i])) {
+            if (lines[i].Count > lines[merged - 1].Count)
+                lines[merged - 1].Count = lines[i].Count;
+        } else {
+            lines[merged++] = lines[i];
+        }
+    }
+    n = merged;
+    // Callees are created after their callers, so totals add up backwards
+    uint64_t *totals = allocate(module->ContextCount, sizeof(uint64_t), "the sample profile");
+    uint8_t *hasLines = totals ? allocate(module->ContextCount, 1, "the sample profile") : NULL;
+    if (!hasLines) {
+        free(totals);
+        free(lines);
+        return;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        totals[lines[i].Context] += lines[i].Count;
+        hasLines[lines[i].Context] = 1;
+    }
+    for (uint32_t c = module->ContextCount; c-- > 0;) {
+        if (!module->Contexts[3 * c])
+            continue;
+        totals[module->Contexts[3 * c] - 1] += totals[c];
+        hasLines[module->Contexts[3 * c] - 1] |= hasLines[c];
+    }
+    for (uint32_t c = 0; c < module->ContextCount; c++) {
+        const uint32_t *context = module->Contexts + 3 * c;
+        if (context[0] || !hasLines[c])
+            continue;
+        fprintf(Profile, "%s:%lu:%lu\n", module->ContextNames[c], (unsigned long)totals[c],
+                (unsigned long)counts[context[1]]);
+        writeContext(module, lines, n, totals, c, 1);
+    }
+    fflush(Profile);
+    free(hasLines);
+    free(totals);
+    free(lines);
+}
+
+// Prints the counts of module->Counters multiplied by scale, detail goes
+// to the summary line
+static void report(const TraceModule *module, uint64_t scale, const char *detail) {
+    OpcodeTotal *totals = allocate(module->OpcodeCount, sizeof(OpcodeTotal), "the instruction counts");
+    uint64_t *counts = totals ? instructionCounts(module, scale) : NULL;
+    if (!counts) {
+        free(totals);
+        return;
+    }
+    uint64_t executed = 0;
+    for (uint32_t i = 0; i < module->OpcodeCount; i++)
+        totals[i].Name = module->OpcodeNames[i];
+    for (uint64_t id = 0; id < module->Count; id++) {
+        if (!counts[id])
+            continue;
+        totals[module->Opcodes[id]].Count += counts[id];
+        executed += counts[id];
+        fprintf(Output, "[COUNT] #%lu: %s %lu\n", (unsigned long)module->Ids[id],
+                module->OpcodeNames[module->Opcodes[id]], (unsigned long)counts[id]);
+    }
+    fprintf(Output, "\nInstruction Counts (%s, %lu executed, %s):\n", module->Name, (unsigned long)executed,
+            detail);
+    fprintf(Output, "===================\n");
+    printTotals(totals, module->OpcodeCount);
+    dumpUses(module, counts);
+    fflush(Output);
+    writeProfile(module, counts);
+    free(counts);
+    free(totals);
+}
+
+void traceCountersDump(TraceModule *module) {
+    char detail[64];
+    snprintf(detail, sizeof(detail), "%u threads", mergeThreads(module));
+    report(module, 1, detail);
+}
+
+void traceSampleRegister(TraceModule *module) {
+    traceCountersRegister(module);
+    const char *period = getenv("TRACE_SAMPLE_PERIOD");
+    if (!period)
+        return;
+    SamplePeriod = strtoull(period, NULL, 10);
+    if (!SamplePeriod) {
+        fprintf(stderr, "[TRACE] Bad TRACE_SAMPLE_PERIOD '%s', using %d\n", period, TRACE_SAMPLE_DEFAULT);
+        SamplePeriod = TRACE_SAMPLE_DEFAULT;
+    }
+}
+
+// Block entries up to the next sample, uniform in [1, 2 * period - 1]: the
+// mean is the period, and the samples do not lock onto a loop whose trip
+// count divides it
+static uint64_t nextCountdown(void) {
+    if (SamplePeriod == 1)
+        return 1;
+    SampleRng ^= SampleRng << 13;
+    SampleRng ^= SampleRng >> 7;
+    SampleRng ^= SampleRng << 17;
+    return 1 + SampleRng % (2 * SamplePeriod - 1);
+}
+
+// Called when the countdown of the calling thread ran out at block, returns
+// the new countdown. The first call of a thread only starts its countdown,
+// its block entry being the first one counted down
+uint64_t traceSample(TraceModule *module, uint32_t block) {
+    if (!SampleRng) {
+        SampleRng = 0x9E3779B97F4A7C15ull * __atomic_add_fetch(&SampleThreads, 1, __ATOMIC_RELAXED);
+        uint64_t countdown = nextCountdown();
+        if (countdown > 1)
+            return countdown - 1;
+    }
+    __atomic_fetch_add(&module->Counters[block], 1, __ATOMIC_RELAXED);
+    return nextCountdown();
+}
+
+void traceSampleDump(TraceModule *module) {
+    uint64_t samples = 0;
+    for (uint64_t c = 0; c < module->CounterCount; c++)
+        samples += module->Counters[c];
+    char detail[64];
+    snprintf(detail, sizeof(detail), "%lu samples, period %lu", (unsigned long)samples,
+             (unsigned long)SamplePeriod);
+    report(module, SamplePeriod, detail);
+}
+
+typedef struct PathCount {
+    const TracePathFunction *Function;
+    uint64_t Path;
+    uint64_t Count;
+} PathCount;
+
+static int byPathCountDesc(const void *a, const void *b) {
+    uint64_t x = ((const PathCount *)a)->Count, y = ((const PathCount *)b)->Count;
+    return (x < y) - (x > y);
+}
+
+// Out-edge of block taken by path, leaves the rest of the path number
+static uint32_t pathEdge(const TracePathFunction *f, uint32_t block, uint64_t *path) {
+    uint32_t e = f->EdgeStart[block];
+    while (e + 1 < f->EdgeStart[block + 1] && f->Edges[2 * (e + 1) + 1] <= *path)
+        e++;
+    *path -= f->Edges[2 * e + 1];
+    return e;
+}
+
+static void printPath(const TracePathFunction *f, uint64_t path) {
+    uint32_t block = 0;
+    uint32_t e = pathEdge(f, block, &path);
+    // A dummy edge out of the entry: the path starts at a loop header
+    if (f->Edges[2 * e] & TRACE_PATH_DUMMY) {
+        block = f->Edges[2 * e] & ~TRACE_PATH_DUMMY;
+        e = pathEdge(f, block, &path);
+    }
+    fprintf(Output, "%s", f->BlockNames[block]);
+    for (;;) {
+        uint32_t target = f->Edges[2 * e] & ~TRACE_PATH_DUMMY;
+        if (target == f->BlockCount) {
+            fprintf(Output, f->Edges[2 * e] & TRACE_PATH_DUMMY ? " (back edge)\n" : " (return)\n");
+            return;
+        }
+        fprintf(Output, " -> %s", f->BlockNames[target]);
+        e = pathEdge(f, target, &path);
+    }
+}
+
+void tracePathsDump(TraceModule *module) {
+    unsigned threads = mergeThreads(module);
+    const char *top = getenv("TRACE_PATHS_TOP");
+    uint64_t limit = top ? strtoull(top, NULL, 10) : TRACE_PATHS_TOP;
+    // Without memory for the list only the per-function totals are printed
+    PathCount *paths = allocate(module->CounterCount, sizeof(PathCount), "the hottest paths");
+    uint64_t n = 0, executed = 0;
+    fprintf(Output, "\nPath Counts (%s, %u threads):\n", module->Name, threads);
+    fprintf(Output, "===================\n");
+    for (uint32_t i = 0; i < module->FunctionCount; i++) {
+        const TracePathFunction *f = &module->Functions[i];
+        uint64_t distinct = 0, total = 0;
+        for (uint64_t p = 0; p < f->PathCount; p++) {
+            uint64_t count = module->Counters[f->Base + p];
+            if (!count)
+                continue;
+            if (paths)
+                paths[n++] = (PathCount){f, p, count};
+            distinct++;
+            total += count;
+        }
+        executed += total;
+        if (total)
+            fprintf(Output, "%s: %lu executed, %lu of %lu paths\n", f->Name, (unsigned long)total,
+                    (unsigned long)distinct, (unsigned long)f->PathCount);
+    }
+    if (!paths) {
+        fflush(Output);
+        return;
+    }
+    qsort(paths, n, sizeof(PathCount), byPathCountDesc);
+    fprintf(Output, "\nHottest Paths (%lu executed):\n", (unsigned long)executed);
+    fprintf(Output, "===================\n");
+    for (uint64_t i = 0; i < n && (!limit || i < limit); i++) {
+        fprintf(Output, "[PATH] %lu %.2f%% %s#%lu: ", (unsigned long)paths[i].Count,
+                100.0 * paths[i].Count / executed, paths[i].Function->Name, (unsigned long)paths[i].Path);
+        printPath(paths[i].Function, paths[i].Path);
+    }
+    fflush(Output);
+    free(paths);
+}
@@ -0,0 +1,238 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace_module.h"
+
+// Runtime of trace-instruction<ngram>: the statistics of analyze.py
+// without a trace. Every thread keeps the opcodes of its last instructions
+// packed 8 bits each into a 64-bit window and counts every sequence ending
+// at the current instruction in a hash table of its own. When the last
+// module is unloaded the tables are merged and the instruction counts and
+// the most common sequences of every length are printed, in the format of
+// trace_analyze. Threads still running at that point must not run
+// instrumented code any more
+//   TRACE_NGRAMS=path        output file (default stdout)
+//   TRACE_NGRAM_LENGTH=n     longest sequence, 1..7 (default 5)
+//   TRACE_NGRAM_TOP=k        sequences printed per length, 0 for all
+//                            (default 15)
+
+#define MAX_LENGTH 7
+#define MAX_OPCODES 256
+// Sequence length in the top byte of a key, so no key is 0
+#define KEY_LENGTH(key) ((unsigned)((key) >> 56))
+
+typedef struct Slot {
+    uint64_t Key;
+    uint64_t Count;
+    // Position of the first occurrence in the thread, orders ties
+    uint64_t First;
+} Slot;
+
+typedef struct Window {
+    uint64_t Packed;
+    uint64_t Seen;
+    Slot *Slots;
+    size_t Capacity;
+    size_t Size;
+    struct Window *Next;
+} Window;
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static Window *Windows = NULL;
+static unsigned WindowCount = 0;
+static const char *Names[MAX_OPCODES];
+static unsigned NameCount = 0;
+static unsigned Length = 5;
+static unsigned long Top = 15;
+static int OpenModules = 0;
+static _Thread_local Window *Current = NULL;
+
+static size_t slotOf(uint64_t key, size_t mask) {
+    return (key * 0x9E3779B97F4A7C15ull >> 20) & mask;
+}
+
+static void insert(Slot *slots, size_t mask, const Slot *s) {
+    size_t i = slotOf(s->Key, mask);
+    while (slots[i].Key)
+        i = (i + 1) & mask;
+    slots[i] = *s;
+}
+
+// Zeroed, aborts when out of memory
+static void *allocate(size_t count, size_t size) {
+    void *p = calloc(count, size);
+    if (!p) {
+        fprintf(stderr, "[TRACE] Out of memory for n-gram counts\n");
+        abort();
+    }
+    return p;
+}
+
+static Slot *allocSlots(size_t capacity) {
+    return allocate(capacity, sizeof(Slot));
+}
+
+static void grow(Window *w) {
+    size_t capacity = 2 * w->Capacity;
+    Slot *slots = allocSlots(capacity);
+    for (size_t i = 0; i < w->Capacity; i++)
+        if (w->Slots[i].Key)
+            insert(slots, capacity - 1, &w->Slots[i]);
+    free(w->Slots);
+    w->Slots = slots;
+    w->Capacity = capacity;
+}
+
+static void add(Window *w, uint64_t key, uint64_t count, uint64_t first) {
+    if (2 * (w->Size + 1) > w->Capacity)
+        grow(w);
+    size_t mask = w->Capacity - 1;
+    for (size_t i = slotOf(key, mask);; i = (i + 1) & mask) {
+        Slot *s = &w->Slots[i];
+        if (s->Key == key) {
+            s->Count += count;
+            if (first < s->First)
+                s->First = first;
+            return;
+        }
+        if (!s->Key) {
+            *s = (Slot){key, count, first};
+            w->Size++;
+            return;
+        }
+    }
+}
+
+static Window *newWindow(void) {
+    Window *w = allocate(1, sizeof(Window));
+    w->Capacity = 1024;
+    w->Slots = allocSlots(w->Capacity);
+    pthread_mutex_lock(&Lock);
+    w->Next = Windows;
+    Windows = w;
+    WindowCount++;
+    pthread_mutex_unlock(&Lock);
+    Current = w;
+    return w;
+}
+
+static unsigned long envNumber(const char *name, unsigned long fallback) {
+    const char *value = getenv(name);
+    return value ? strtoul(value, NULL, 10) : fallback;
+}
+
+// Maps the opcodes of the module to process-wide IDs
+void traceNgramRegister(TraceModule *module) {
+    uint8_t *ids = allocate(module->OpcodeCount ? module->OpcodeCount : 1, 1);
+    pthread_mutex_lock(&Lock);
+    if (!OpenModules++) {
+        Length = envNumber("TRACE_NGRAM_LENGTH", 5);
+        Top = envNumber("TRACE_NGRAM_TOP", 15);
+        if (Length < 1 || Length > MAX_LENGTH) {
+            fprintf(stderr, "[TRACE] TRACE_NGRAM_LENGTH must be 1..%d, using 5\n", MAX_LENGTH);
+            Length = 5;
+        }
+    }
+    for (uint32_t i = 0; i < module->OpcodeCount; i++) {
+        unsigned id = 0;
+        while (id < NameCount && strcmp(Names[id], module->OpcodeNames[i]))
+            id++;
+        if (id == NameCount) {
+            if (NameCount == MAX_OPCODES) {
+                fprintf(stderr, "[TRACE] More than %d distinct opcodes\n", MAX_OPCODES);
+                exit(EXIT_FAILURE);
+            }
+            Names[NameCount++] = module->OpcodeNames[i];
+        }
+        ids[i] = id;
+    }
+    module->Runtime = ids;
+    pthread_mutex_unlock(&Lock);
+}
+
+void traceNgram(TraceModule *module, uint32_t opcode) {
+    Window *w = Current ? Current : newWindow();
+    w->Packed = (w->Packed << 8) | ((const uint8_t *)module->Runtime)[opcode];
+    uint64_t position = w->Seen++;
+    unsigned longest = w->Seen < Length ? (unsigned)w->Seen : Length;
+    for (unsigned k = 1; k <= longest; k++) {
+        uint64_t key = (uint64_t)k << 56 | (w->Packed & (~0ull >> (64 - 8 * k)));
+        add(w, key, 1, position + 1 - k);
+    }
+}
+
+static int mostCommon(const void *a, const void *b) {
+    const Slot *x = a, *y = b;
+    if (x->Count != y->Count)
+        return x->Count < y->Count ? 1 : -1;
+    if (x->First != y->First)
+        return x->First < y->First ? -1 : 1;
+    return (x->Key > y->Key) - (x->Key < y->Key);
+}
+
+static void printSequence(FILE *out, uint64_t key) {
+    unsigned k = KEY_LENGTH(key);
+    for (unsigned i = 0; i < k; i++)
+        fprintf(out, "%s%s", i ? " -> " : "", Names[(key >> (8 * (k - 1 - i))) & 0xFF]);
+}
+
+static void dump(void) {
+    Window merged = {0};
+    merged.Capacity = 1024;
+    merged.Slots = allocSlots(merged.Capacity);
+    uint64_t total = 0;
+    for (Window *w = Windows; w; w = w->Next) {
+        total += w->Seen;
+        for (size_t i = 0; i < w->Capacity; i++)
+            if (w->Slots[i].Key)
+                add(&merged, w->Slots[i].Key, w->Slots[i].Count, w->Slots[i].First);
+    }
+    Slot *sorted = allocate(merged.Size ? merged.Size : 1, sizeof(Slot));
+    size_t n = 0;
+    for (size_t i = 0; i < merged.Capacity; i++)
+        if (merged.Slots[i].Key)
+            sorted[n++] = merged.Slots[i];
+    qsort(sorted, n, sizeof(Slot), mostCommon);
+
+    const char *path = getenv("TRACE_NGRAMS");
+    FILE *out = path ? fopen(path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "[TRACE] Can't open %s for writing\n", path);
+        out = stdout;
+    }
+    fprintf(out, "\nInstruction Counts:\n");
+    fprintf(out, "===================\n");
+    for (size_t i = 0; i < n; i++)
+        if (KEY_LENGTH(sorted[i].Key) == 1)
+            fprintf(out, "%s: %lu\n", Names[sorted[i].Key & 0xFF], (unsigned long)sorted[i].Count);
+    for (unsigned k = 2; k <= Length; k++) {
+        fprintf(out, "\nSequences of Length %u:\n", k);
+        fprintf(out, "===================\n");
+        unsigned long printed = 0;
+        for (size_t i = 0; i < n && (!Top || printed < Top); i++) {
+            if (KEY_LENGTH(sorted[i].Key) != k)
+                continue;
+            printSequence(out, sorted[i].Key);
+            fprintf(out, ": %lu (%.4f)\n", (unsigned long)sorted[i].Count, (double)sorted[i].Count / total);
+            printed++;
+        }
+    }
+    fflush(out);
+    if (out != stdout)
+        fclose(out);
+    fprintf(stderr, "[TRACE] %lu instructions, %zu sequences from %u threads\n", (unsigned long)total, n,
+            WindowCount);
+    free(sorted);
+    free(merged.Slots);
+}
+
+// The last module unloaded prints the merged counts of all threads
+void traceNgramDump(TraceModule *module) {
+    (void)module;
+    pthread_mutex_lock(&Lock);
+    if (!--OpenModules)
+        dump();
+    pthread_mutex_unlock(&Lock);
+}
@@ -0,0 +1,365 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Compiled replacement for the counting part of analyze.py
+//   trace_analyze [-j threads] [-l max length] [-n top] [-o out.json] traces.log
+// Prints the "Instruction Counts" of print_instruction_counts and the most
+// frequent sequences of find_repeated_sequences with their frequencies
+// (occurrences / instructions), ties in order of first occurrence like
+// Counter.most_common. -o writes the same as JSON for analyze.py --json,
+// -n 0 keeps all sequences
+//
+// The log is mmapped and split at line boundaries into one shard per
+// thread. A thread interns the opcodes of its shard to small integers, the
+// tables are merged in file order so the IDs follow first occurrence.
+// Sequences of up to 7 opcodes are packed 8 bits per opcode into a rolling
+// 64-bit key (length in the top byte) and counted in a flat open-addressing
+// table per shard. A shard counts the sequences ending in it, those starting
+// in the shards before it included: its window starts with their last
+// opcodes
+
+static const unsigned MaxLength = 7;
+static const unsigned MaxOpcodes = 256;
+
+// Sequence key -> occurrences and position of the first one
+class SequenceTable {
+public:
+  struct Slot {
+    uint64_t Key;
+    uint64_t Count;
+    uint64_t First;
+  };
+
+  SequenceTable() : Slots(1024, Slot{0, 0, 0}) {}
+
+  void add(uint64_t Key, uint64_t Count, uint64_t First) {
+    if (2 * (Size + 1) > Slots.size())
+      grow();
+    size_t Mask = Slots.size() - 1;
+    for (size_t I = hash(Key) & Mask;; I = (I + 1) & Mask) {
+      Slot &S = Slots[I];
+      if (S.Key == Key) {
+        S.Count += Count;
+        S.First = std::min(S.First, First);
+        return;
+      }
+      if (!S.Key) {
+        S = Slot{Key, Count, First};
+        Size++;
+        return;
+      }
+    }
+  }
+
+  const std::vector<Slot> &slots() const { return Slots; }
+
+private:
+  std::vector<Slot> Slots;
+  size_t Size = 0;
+
+  static size_t hash(uint64_t Key) { return (Key * 0x9E3779B97F4A7C15ull) >> 20; }
+
+  void grow() {
+    std::vector<Slot> Old(2 * Slots.size(), Slot{0, 0, 0});
+    Old.swap(Slots);
+    Size = 0;
+    for (const Slot &S : Old)
+      if (S.Key)
+        add(S.Key, S.Count, S.First);
+  }
+};
+
+struct Shard {
+  const char *Begin;
+  const char *End;
+  // Opcodes in shard order: local IDs after parsing, global after remap
+  std::vector<uint8_t> Ops;
+  std::vector<std::string> Names;
+  // Opcodes of the shards before, up to MaxLength - 1
+  std::vector<uint8_t> Context;
+  uint64_t Offset = 0;
+  SequenceTable Table;
+  bool Overflow = false;
+};
+
+static bool isWordChar(char C) {
+  return (C >= 'a' && C <= 'z') || (C >= 'A' && C <= 'Z') || (C >= '0' && C <= '9') || C == '_';
+}
+
+// Opcode of a log line, the first match of \[INSTR\] #\d+: (\w+)
+static bool matchInstruction(const char *P, const char *End, const char *&Name, size_t &Length) {
+  static const char Marker[] = "[INSTR] #";
+  const size_t MarkerLength = sizeof(Marker) - 1;
+  for (; (P = static_cast<const char *>(memchr(P, '[', End - P))); P++) {
+    if (static_cast<size_t>(End - P) < MarkerLength || memcmp(P, Marker, MarkerLength))
+      continue;
+    const char *Q = P + MarkerLength;
+    const char *Digits = Q;
+    while (Q < End && *Q >= '0' && *Q <= '9')
+      Q++;
+    if (Q == Digits || End - Q < 2 || Q[0] != ':' || Q[1] != ' ')
+      continue;
+    Q += 2;
+    Name = Q;
+    while (Q < End && isWordChar(*Q))
+      Q++;
+    if (Q == Name)
+      continue;
+    Length = Q - Name;
+    return true;
+  }
+  return false;
+}
+
+static void parseShard(Shard &S) {
+  // Name hash -> local ID + 1, a handful of opcodes never fill it
+  int16_t Index[2 * MaxOpcodes] = {};
+  for (const char *P = S.Begin; P < S.End;) {
+    const char *Eol = static_cast<const char *>(memchr(P, '\n', S.End - P));
+    if (!Eol)
+      Eol = S.End;
+    const char *Name;
+    size_t Length;
+    if (matchInstruction(P, Eol, Name, Length)) {
+      uint32_t Hash = 2166136261u;
+      for (size_t I = 0; I < Length; I++)
+        Hash = (Hash ^ static_cast<unsigned char>(Name[I])) * 16777619u;
+      size_t Slot = Hash % (2 * MaxOpcodes);
+      while (Index[Slot] && S.Names[Index[Slot] - 1].compare(0, std::string::npos, Name, Length))
+        Slot = (Slot + 1) % (2 * MaxOpcodes);
+      if (!Index[Slot]) {
+        if (S.Names.size() == MaxOpcodes) {
+          S.Overflow = true;
+          return;
+        }
+        S.Names.emplace_back(Name, Length);
+        Index[Slot] = S.Names.size();
+      }
+      S.Ops.push_back(Index[Slot] - 1);
+    }
+    P = Eol + 1;
+  }
+}
+
+static void countShard(Shard &S, unsigned Length) {
+  std::vector<uint8_t> Window(S.Context);
+  Window.insert(Window.end(), S.Ops.begin(), S.Ops.end());
+  uint64_t Start = S.Offset - S.Context.size();
+  uint64_t Packed = 0;
+  for (size_t J = 0; J < Window.size(); J++) {
+    Packed = (Packed << 8) | Window[J];
+    if (J < S.Context.size())
+      continue;
+    unsigned Longest = std::min<uint64_t>(Length, Start + J + 1);
+    for (unsigned K = 1; K <= Longest; K++) {
+      uint64_t Key = (static_cast<uint64_t>(K) << 56) | (Packed & ((1ull << (8 * K)) - 1));
+      S.Table.add(Key, 1, Start + J + 1 - K);
+    }
+  }
+}
+
+struct Sequence {
+  uint64_t Key;
+  uint64_t Count;
+  uint64_t First;
+};
+
+static bool mostCommon(const Sequence &A, const Sequence &B) {
+  return A.Count != B.Count ? A.Count > B.Count : A.First < B.First;
+}
+
+// Opcodes of a key, oldest first
+static std::vector<uint8_t> unpack(uint64_t Key) {
+  unsigned K = Key >> 56;
+  std::vector<uint8_t> Ops(K);
+  for (unsigned I = 0; I < K; I++)
+    Ops[I] = Key >> (8 * (K - 1 - I));
+  return Ops;
+}
+
+static void printJsonString(FILE *Out, const std::string &Str) {
+  // Opcode names are \w+, nothing to escape
+  fprintf(Out, "\"%s\"", Str.c_str());
+}
+
+int main(int argc, char **argv) {
+  unsigned Threads = std::max(1u, std::thread::hardware_concurrency());
+  unsigned Length = 5;
+  size_t Top = 15;
+  const char *JsonPath = nullptr;
+  int Opt;
+  while ((Opt = getopt(argc, argv, "j:l:n:o:")) != -1) {
+    switch (Opt) {
+    case 'j':
+      Threads = std::max(1, atoi(optarg));
+      break;
+    case 'l':
+      Length = atoi(optarg);
+      break;
+    case 'n':
+      Top = strtoul(optarg, nullptr, 10);
+      break;
+    case 'o':
+      JsonPath = optarg;
+      break;
+    default:
+      optind = argc + 1;
+    }
+  }
+  if (optind + 1 != argc || Length < 1 || Length > MaxLength) {
+    fprintf(stderr, "Usage: %s [-j threads] [-l max length, 1..%u] [-n top] [-o out.json] <trace log>\n",
+            argv[0], MaxLength);
+    return EXIT_FAILURE;
+  }
+
+  int Fd = open(argv[optind], O_RDONLY);
+  struct stat St;
+  if (Fd < 0 || fstat(Fd, &St)) {
+    fprintf(stderr, "[ERROR] Can't read %s\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+  size_t Size = St.st_size;
+  const char *Data = "";
+  if (Size) {
+    void *Map = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, Fd, 0);
+    if (Map == MAP_FAILED) {
+      fprintf(stderr, "[ERROR] Can't map %s\n", argv[optind]);
+      return EXIT_FAILURE;
+    }
+    madvise(Map, Size, MADV_SEQUENTIAL);
+    Data = static_cast<const char *>(Map);
+  }
+
+  // Shards of at least 1 MB, cut after a newline
+  size_t ShardCount = std::min<size_t>(Threads, Size / (1 << 20) + 1);
+  std::vector<Shard> Shards(ShardCount);
+  const char *Cut = Data;
+  for (size_t I = 0; I < ShardCount; I++) {
+    const char *End = Data + Size * (I + 1) / ShardCount;
+    if (End < Cut)
+      End = Cut;
+    const char *Eol = static_cast<const char *>(memchr(End, '\n', Data + Size - End));
+    End = I + 1 == ShardCount || !Eol ? Data + Size : Eol + 1;
+    Shards[I].Begin = Cut;
+    Shards[I].End = End;
+    Cut = End;
+  }
+  auto forEachShard = [&Shards](void (*Work)(Shard &, unsigned), unsigned Arg) {
+    std::vector<std::thread> Workers;
+    for (size_t I = 1; I < Shards.size(); I++)
+      Workers.emplace_back(Work, std::ref(Shards[I]), Arg);
+    Work(Shards[0], Arg);
+    for (std::thread &W : Workers)
+      W.join();
+  };
+  forEachShard([](Shard &S, unsigned) { parseShard(S); }, 0);
+
+  // Global IDs in order of first occurrence in the file
+  std::vector<std::string> Names;
+  uint64_t Total = 0;
+  for (Shard &S : Shards) {
+    uint8_t Remap[MaxOpcodes];
+    for (size_t L = 0; L < S.Names.size(); L++) {
+      auto It = std::find(Names.begin(), Names.end(), S.Names[L]);
+      if (It == Names.end() && Names.size() == MaxOpcodes)
+        S.Overflow = true;
+      Remap[L] = It - Names.begin();
+      if (It == Names.end())
+        Names.push_back(S.Names[L]);
+    }
+    if (S.Overflow) {
+      fprintf(stderr, "[ERROR] More than %u distinct opcodes\n", MaxOpcodes);
+      return EXIT_FAILURE;
+    }
+    for (uint8_t &Op : S.Ops)
+      Op = Remap[Op];
+    S.Offset = Total;
+    Total += S.Ops.size();
+  }
+  std::vector<uint8_t> Tail;
+  for (Shard &S : Shards) {
+    S.Context = Tail;
+    Tail.insert(Tail.end(), S.Ops.begin(), S.Ops.end());
+    if (Tail.size() > Length - 1)
+      Tail.erase(Tail.begin(), Tail.end() - (Length - 1));
+  }
+  forEachShard(countShard, Length);
+
+  SequenceTable Merged;
+  for (const Shard &S : Shards)
+    for (const SequenceTable::Slot &Slot : S.Table.slots())
+      if (Slot.Key)
+        Merged.add(Slot.Key, Slot.Count, Slot.First);
+  std::vector<std::vector<Sequence>> ByLength(Length + 1);
+  for (const SequenceTable::Slot &Slot : Merged.slots())
+    if (Slot.Key)
+      ByLength[Slot.Key >> 56].push_back(Sequence{Slot.Key, Slot.Count, Slot.First});
+  for (std::vector<Sequence> &Sequences : ByLength)
+    std::sort(Sequences.begin(), Sequences.end(), mostCommon);
+  // Length 1 sequences are the instruction counts, all of them are printed
+  std::vector<Sequence> Counts(ByLength[1]);
+  for (std::vector<Sequence> &Sequences : ByLength)
+    if (Top && Sequences.size() > Top)
+      Sequences.resize(Top);
+
+  printf("\nInstruction Counts:\n");
+  printf("===================\n");
+  for (const Sequence &S : Counts)
+    printf("%s: %lu\n", Names[S.Key & 0xFF].c_str(), static_cast<unsigned long>(S.Count));
+  for (unsigned K = 2; K <= Length; K++) {
+    printf("\nSequences of Length %u:\n", K);
+    printf("===================\n");
+    for (const Sequence &S : ByLength[K]) {
+      std::vector<uint8_t> Ops = unpack(S.Key);
+      for (size_t I = 0; I < Ops.size(); I++)
+        printf("%s%s", I ? " -> " : "", Names[Ops[I]].c_str());
+      printf(": %lu (%.4f)\n", static_cast<unsigned long>(S.Count), static_cast<double>(S.Count) / Total);
+    }
+  }
+  fprintf(stderr, "[ANALYZE] %lu instructions, %zu opcodes, %zu threads\n", static_cast<unsigned long>(Total),
+          Names.size(), Shards.size());
+
+  if (JsonPath) {
+    FILE *Out = fopen(JsonPath, "w");
+    if (!Out) {
+      fprintf(stderr, "[ERROR] Can't open %s for writing\n", JsonPath);
+      return EXIT_FAILURE;
+    }
+    fprintf(Out, "{\"total\": %lu, \"counts\": {", static_cast<unsigned long>(Total));
+    for (size_t I = 0; I < Counts.size(); I++) {
+      fprintf(Out, "%s", I ? ", " : "");
+      printJsonString(Out, Names[Counts[I].Key & 0xFF]);
+      fprintf(Out, ": %lu", static_cast<unsigned long>(Counts[I].Count));
+    }
+    fprintf(Out, "},\n \"sequences\": [");
+    for (unsigned K = 1; K <= Length; K++) {
+      fprintf(Out, "%s\n  [", K > 1 ? "," : "");
+      for (size_t I = 0; I < ByLength[K].size(); I++) {
+        const Sequence &S = ByLength[K][I];
+        std::vector<uint8_t> Ops = unpack(S.Key);
+        fprintf(Out, "%s{\"sequence\": [", I ? ",\n   " : "");
+        for (size_t J = 0; J < Ops.size(); J++) {
+          fprintf(Out, "%s", J ? ", " : "");
+          printJsonString(Out, Names[Ops[J]]);
+        }
+        fprintf(Out, "], \"count\": %lu, \"frequency\": %.17g}", static_cast<unsigned long>(S.Count),
+                static_cast<double>(S.Count) / Total);
+      }
+      fprintf(Out, "]");
+    }
+    fprintf(Out, "\n]}\n");
+    fclose(Out);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+
+// Binary trace written by log_binary.c and read by trace_decode.c, native
+// byte order
+//
+// Header: "TRCB", u32 version, u32 flags. Then chunks, each a u32 type and
+// the u32 payload size in bytes:
+//   TRACE_CHUNK_MODULE  u64 base, u64 count, u32 opcode count, module name
+//                       and opcode names as NUL terminated strings,
+//                       u32 opcode index per instruction, u64 stable ID
+//                       per instruction
+//   TRACE_CHUNK_EVENTS  u32 thread, u32 n, n u32 instruction indices
+//                       (module base + index in the module), with TRACE_FLAG_TIMESTAMPS
+//                       n u64 CLOCK_MONOTONIC nanoseconds
+// Events of one thread are in order, chunks of different threads interleave
+// in the order they were written
+
+#define TRACE_BINARY_MAGIC "TRCB"
+#define TRACE_BINARY_VERSION 2
+#define TRACE_FLAG_TIMESTAMPS 1
+
+enum TraceChunk {
+    TRACE_CHUNK_MODULE = 1,
+    TRACE_CHUNK_EVENTS,
+};
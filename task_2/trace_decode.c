@@ -0,0 +1,152 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim_file.h"
+#include "trace_binary.h"
+
+// Converts a trace-instruction<binary> trace to the text log format of
+// log.c ("[INSTR] #id: opcode"), so analyze.py works on it unchanged
+//   trace_decode [-t] trace.bin > traces.log
+// -t appends the thread and, when recorded, the timestamp to every line
+
+typedef struct Module {
+    uint64_t Base;
+    uint64_t Count;
+    const char **OpcodeNames;
+    const uint8_t *Opcodes;
+    const uint8_t *Ids;
+} Module;
+
+static uint32_t get32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t get64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Parses a module chunk, the strings and tables stay in the file buffer
+static int readModule(Module *m, const uint8_t *p, const uint8_t *end) {
+    if (end - p < 20)
+        return 0;
+    m->Base = get64(p);
+    m->Count = get64(p + 8);
+    uint32_t opcodeCount = get32(p + 16);
+    p += 20;
+    m->OpcodeNames = calloc(opcodeCount, sizeof(char *));
+    // Module name first, then the opcode names
+    for (uint32_t i = 0; i <= opcodeCount; i++) {
+        const uint8_t *nul = memchr(p, 0, end - p);
+        if (!nul)
+            return 0;
+        if (i)
+            m->OpcodeNames[i - 1] = (const char *)p;
+        p = nul + 1;
+    }
+    if ((uint64_t)(end - p) / (sizeof(uint32_t) + sizeof(uint64_t)) < m->Count)
+        return 0;
+    m->Opcodes = p;
+    m->Ids = p + 4 * m->Count;
+    for (uint64_t i = 0; i < m->Count; i++)
+        if (get32(p + 4 * i) >= opcodeCount)
+            return 0;
+    return 1;
+}
+
+// Opcode name and stable ID of an event, NULL for an unknown index
+static const char *lookup(const Module *modules, int count, uint32_t index, uint64_t *id) {
+    for (int i = 0; i < count; i++) {
+        const Module *m = &modules[i];
+        if (index < m->Base || index - m->Base >= m->Count)
+            continue;
+        uint64_t local = index - m->Base;
+        *id = get64(m->Ids + 8 * local);
+        return m->OpcodeNames[get32(m->Opcodes + 4 * local)];
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t")) != -1) {
+        if (opt != 't') {
+            fprintf(stderr, "Usage: %s [-t] <trace>\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        verbose = 1;
+    }
+    if (optind + 1 != argc) {
+        fprintf(stderr, "Usage: %s [-t] <trace>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    size_t size = 0;
+    uint8_t *data = simReadFile(argv[optind], &size);
+    if (!data) {
+        fprintf(stderr, "[ERROR] Can't read %s\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (size < 12 || memcmp(data, TRACE_BINARY_MAGIC, 4) || get32(data + 4) != TRACE_BINARY_VERSION) {
+        fprintf(stderr, "[ERROR] %s is not a binary trace\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    int timestamps = get32(data + 8) & TRACE_FLAG_TIMESTAMPS;
+    static char buffer[1 << 20];
+    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+    Module *modules = NULL;
+    int moduleCount = 0;
+    uint64_t events = 0;
+    const uint8_t *p = data + 12;
+    const uint8_t *end = data + size;
+    while (p < end) {
+        if (end - p < 8 || get32(p + 4) > (uint64_t)(end - p - 8))
+            goto corrupt;
+        uint32_t type = get32(p);
+        const uint8_t *chunk = p + 8;
+        const uint8_t *chunkEnd = chunk + get32(p + 4);
+        p = chunkEnd;
+        if (type == TRACE_CHUNK_MODULE) {
+            modules = realloc(modules, (moduleCount + 1) * sizeof(Module));
+            if (!readModule(&modules[moduleCount++], chunk, chunkEnd))
+                goto corrupt;
+        } else if (type == TRACE_CHUNK_EVENTS) {
+            if (chunkEnd - chunk < 8)
+                goto corrupt;
+            uint32_t thread = get32(chunk);
+            uint32_t n = get32(chunk + 4);
+            const uint8_t *ids = chunk + 8;
+            const uint8_t *times = ids + 4 * (size_t)n;
+            if ((size_t)(chunkEnd - ids) < (size_t)n * (4 + (timestamps ? 8 : 0)))
+                goto corrupt;
+            for (uint32_t i = 0; i < n; i++) {
+                uint64_t id;
+                const char *name = lookup(modules, moduleCount, get32(ids + 4 * i), &id);
+                if (!name)
+                    goto corrupt;
+                if (!verbose)
+                    printf("[INSTR] #%lu: %s\n", (unsigned long)id, name);
+                else if (timestamps)
+                    printf("[INSTR] #%lu: %s thread=%u t=%lu\n", (unsigned long)id, name, thread,
+                           (unsigned long)get64(times + 8 * i));
+                else
+                    printf("[INSTR] #%lu: %s thread=%u\n", (unsigned long)id, name, thread);
+            }
+            events += n;
+        }
+    }
+    fflush(stdout);
+    fprintf(stderr, "[DECODE] %lu events, %d modules\n", (unsigned long)events, moduleCount);
+    return EXIT_SUCCESS;
+
+corrupt:
+    fflush(stdout);
+    fprintf(stderr, "[ERROR] Trace is corrupt at offset %ld\n", (long)(p - data));
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <stdint.h>
+
+// Path mode: Ball-Larus DAG of a profiled function. Blocks are numbered in
+// function order, 0 is the entry. The out-edges of block b are the pairs
+// EdgeStart[b] up to EdgeStart[b + 1] - 1 of Edges: target block (BlockCount
+// for the exit, TRACE_PATH_DUMMY set for the dummy edges standing for a
+// back edge) and increment, increments ascending
+#define TRACE_PATH_DUMMY 0x80000000u
+
+typedef struct TracePathFunction {
+    const char *Name;
+    // Path p is counted by counter Base + p
+    uint64_t Base;
+    uint64_t PathCount;
+    uint32_t BlockCount;
+    const char *const *BlockNames;
+    const uint32_t *EdgeStart;
+    const uint32_t *Edges;
+} TracePathFunction;
+
+// Descriptor the pass emits for every instrumented module (all modes but
+// text), see instrumentModule in PassTraceInstructions.cpp. The module
+// constructor hands it to the runtime of the mode
+
+typedef struct TraceModule {
+    const char *Name;
+    // Instructions
+    uint64_t Count;
+    // Counter and block modes only
+    uint64_t *Counters;
+    uint64_t CounterCount;
+    // Block mode: counter i counts instructions BlockStart[i] up to
+    // BlockStart[i + 1]. NULL when there is a counter per instruction
+    const uint32_t *BlockStart;
+    // Opcode of every instruction, index into OpcodeNames
+    const uint32_t *Opcodes;
+    const char *const *OpcodeNames;
+    uint32_t OpcodeCount;
+    // Def-use edges as (def ID, user opcode, number of uses) triples
+    const uint32_t *Uses;
+    uint64_t UseCount;
+    // Set by the runtime: first process-wide ID of the module
+    uint64_t Base;
+    // Stable ID of every instruction, the one text mode prints: function
+    // hash in the high half, position in the function in the low half
+    const uint64_t *Ids;
+    // Owned by the runtime of the mode. Counter and block modes: counter
+    // arrays of the threads that ran the module, merged into Counters at
+    // exit. Ngram mode: process-wide ID of every opcode
+    void *Runtime;
+    // Path mode: profiled functions, Counters holds their path counts
+    const TracePathFunction *Functions;
+    uint32_t FunctionCount;
+    // Counting modes with debug info, NULL otherwise: inline contexts and
+    // source lines for the sample profile. Context c is the function
+    // ContextNames[c]; with Contexts[3c] == 0 a top-level one starting at
+    // instruction Contexts[3c + 1], else inlined into context
+    // Contexts[3c] - 1 at line offset Contexts[3c + 1], discriminator
+    // Contexts[3c + 2]. Instruction i is at line offset Locations[3i + 1],
+    // discriminator Locations[3i + 2] of context Locations[3i] - 1, or has
+    // no line when Locations[3i] is 0
+    const uint32_t *Contexts;
+    const char *const *ContextNames;
+    uint32_t ContextCount;
+    const uint32_t *Locations;
+} TraceModule;
@@ -30,9 +30,10 @@ constexpr int REG_SP_INDEX = REG_FILE_SIZE + 1;   // Index for Stack Pointer (SP
 constexpr int TOTAL_REG_SIZE = REG_FILE_SIZE + 2; // Total registers including FP and SP
 constexpr int STACK_SIZE = 1024;
 
-// Register file and stack memory
-uint32_t REG_FILE[TOTAL_REG_SIZE] = {0}; // Initialize all registers to zero
-uint32_t STACK[STACK_SIZE] = {0};        // Initialize stack memory to zero
+// Register file and stack memory, per thread so several simulations can
+// share a process (see simContextRun)
+thread_local uint32_t REG_FILE[TOTAL_REG_SIZE] = {0}; // Initialize all registers to zero
+thread_local uint32_t STACK[STACK_SIZE] = {0};        // Initialize stack memory to zero
 
 // Function prototypes for assembler instructions
 void do_MOV(int dst, int src);
@@ -111,8 +112,25 @@ int do_POP_RETURN() {
     return STACK[REG_FILE[REG_SP_INDEX]++];
 }
 
+// Pixels are queued and handed to the sim in one simPutPixels call
+constexpr int PIXEL_BATCH_SIZE = 1024;
+thread_local int PIXEL_BATCH_X[PIXEL_BATCH_SIZE];
+thread_local int PIXEL_BATCH_Y[PIXEL_BATCH_SIZE];
+thread_local int PIXEL_BATCH_COLOR[PIXEL_BATCH_SIZE];
+thread_local int PIXEL_BATCH_LEN = 0;
+
+void flushPixelBatch() {
+    simPutPixels(PIXEL_BATCH_X, PIXEL_BATCH_Y, PIXEL_BATCH_COLOR, PIXEL_BATCH_LEN);
+    PIXEL_BATCH_LEN = 0;
+}
+
 void do_SIM_PUT_PIXEL(int x, int y, int color) {
-    simPutPixel(REG_FILE[x], REG_FILE[y], REG_FILE[color]);
+    PIXEL_BATCH_X[PIXEL_BATCH_LEN] = REG_FILE[x];
+    PIXEL_BATCH_Y[PIXEL_BATCH_LEN] = REG_FILE[y];
+    PIXEL_BATCH_COLOR[PIXEL_BATCH_LEN] = REG_FILE[color];
+    if (++PIXEL_BATCH_LEN == PIXEL_BATCH_SIZE) {
+        flushPixelBatch();
+    }
 }
 
 void do_SIM_RAND(int reg) {
@@ -120,6 +138,7 @@ void do_SIM_RAND(int reg) {
 }
 
 void do_SIM_FLUSH() {
+    flushPixelBatch();
     simFlush();
 }
 
@@ -586,6 +605,7 @@ int main(int argc, char *argv[]) {
     ee->runFunctionAsMain(mainFunc, {}, nullptr);
 
     // Exit simulation
+    flushPixelBatch();
     simExit();
     return EXIT_SUCCESS;
 }
\ No newline at end of file